@@ -18,6 +18,25 @@ extern "C" {
 #define EPOLL_CLOEXEC O_CLOEXEC
 #define EPOLL_NONBLOCK O_NONBLOCK
 
+/*
+ * epoll-shim extension: Poll fds that kqueue does not support (such as some
+ * device fds) from a helper thread instead of on every epoll_wait call.
+ */
+#define EPOLL_POLLER_THREAD (1 << 30)
+
+/*
+ * epoll-shim extension: Spread the registered fds over several kqueues so
+ * that threads waiting on the same epoll fd harvest events in parallel.
+ */
+#define EPOLL_SHARDED (1 << 29)
+
+/*
+ * epoll-shim extension: The epoll fd is only ever used by one thread at a
+ * time, so its internal locking is skipped. Cannot be combined with
+ * EPOLL_POLLER_THREAD.
+ */
+#define EPOLL_SINGLE_THREADED (1 << 28)
+
 enum EPOLL_EVENTS { __EPOLL_DUMMY };
 #define EPOLLIN 0x001
 #define EPOLLPRI 0x002
@@ -63,6 +82,80 @@ int epoll_ctl(int, int, int, struct epoll_event *);
 int epoll_wait(int, struct epoll_event *, int, int);
 int epoll_pwait(int, struct epoll_event *, int, int, const sigset_t *);
 
+/*
+ * epoll-shim extension: For eventfds and timerfds registered with
+ * EPOLLCONSUME, epoll_wait_ex reads the counter (or expiration count) when
+ * delivering EPOLLIN and stores it in 'value', which saves the subsequent
+ * read(2). epoll_wait ignores the flag.
+ *
+ * epoll_wait_ex also passes on what kqueue reports along with the event:
+ * 'nreadable' is the number of bytes readable (or of pending connections
+ * on a listening socket), 'nwritable' the free space for writing, -1 if
+ * unknown. 'error' is the pending socket error on EOF (as by SO_ERROR).
+ */
+#define EPOLLCONSUME (1U<<26)
+
+struct epoll_event_ex {
+	uint32_t events;
+	epoll_data_t data;
+	uint64_t value;
+	int64_t nreadable;
+	int64_t nwritable;
+	int error;
+};
+
+int epoll_wait_ex(int, struct epoll_event_ex *, int, int);
+
+/*
+ * epoll-shim extension: Like epoll_ctl, but only report EPOLLIN (EPOLLOUT)
+ * once at least 'rcvlowat' bytes are readable ('sndlowat' bytes are
+ * writable). Zero means no low-water mark. Applies to sockets and pipes.
+ */
+struct epoll_lowat {
+	int rcvlowat;
+	int sndlowat;
+};
+
+int epoll_ctl_ex(int, int, int, struct epoll_event *,
+    const struct epoll_lowat *);
+
+/*
+ * epoll-shim extension: Registrations are removed automatically when their
+ * fd is closed through 'close' (epoll_shim_close) or found to be invalid
+ * while polling. epoll_evictions stores how often that happened.
+ */
+int epoll_evictions(int, unsigned long *);
+
+/*
+ * epoll-shim extension: Kernel features the shim found when probing the
+ * running kernel, for diagnostics. Code paths are picked accordingly.
+ */
+#define EPOLL_SHIM_CAP_EVFILT_USER 0x01
+#define EPOLL_SHIM_CAP_EVFILT_EXCEPT 0x02
+#define EPOLL_SHIM_CAP_NOTE_USECONDS 0x04
+#define EPOLL_SHIM_CAP_ZERO_TIMER 0x08
+#define EPOLL_SHIM_CAP_QUIRKY_EVFILT_TIMER 0x10
+#define EPOLL_SHIM_CAP_FIFO_EPIPE 0x20
+#define EPOLL_SHIM_CAP_FIFO_EBADF 0x40
+unsigned int epoll_shim_kernel_caps(void);
+
+/*
+ * epoll-shim extension: A handle is a reference to the object behind a
+ * shimmed fd. The '_h' variants of functions take a handle instead of an fd
+ * and skip the fd lookup. The object stays alive until the fd is closed and
+ * all handles have been put. Until then, closing the fd does not release
+ * its number.
+ */
+#ifndef SHIM_SYS_SHIM_HANDLE
+#define SHIM_SYS_SHIM_HANDLE
+struct epoll_shim_handle;
+extern struct epoll_shim_handle *epoll_shim_handle_get(int);
+extern void epoll_shim_handle_put(struct epoll_shim_handle *);
+#endif
+
+int epoll_ctl_h(struct epoll_shim_handle *, int, int, struct epoll_event *);
+int epoll_wait_h(struct epoll_shim_handle *, struct epoll_event *, int, int);
+
 
 #ifndef SHIM_SYS_SHIM_HELPERS
 #define SHIM_SYS_SHIM_HELPERS
@@ -18,6 +18,19 @@ int eventfd(unsigned int, int);
 int eventfd_read(int, eventfd_t *);
 int eventfd_write(int, eventfd_t);
 
+/*
+ * epoll-shim extension: See <sys/epoll.h>. Unlike eventfd_write,
+ * eventfd_write_h takes no locks and is async-signal-safe.
+ */
+#ifndef SHIM_SYS_SHIM_HANDLE
+#define SHIM_SYS_SHIM_HANDLE
+struct epoll_shim_handle;
+extern struct epoll_shim_handle *epoll_shim_handle_get(int);
+extern void epoll_shim_handle_put(struct epoll_shim_handle *);
+#endif
+
+int eventfd_write_h(struct epoll_shim_handle *, eventfd_t);
+
 
 #ifndef SHIM_SYS_SHIM_HELPERS
 #define SHIM_SYS_SHIM_HELPERS
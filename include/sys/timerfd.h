@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <time.h>
 #include <fcntl.h>
 
@@ -14,12 +15,50 @@ extern "C" {
 #define TFD_TIMER_ABSTIME 1
 #define TFD_TIMER_CANCEL_ON_SET (1 << 1)
 
+/*
+ * epoll-shim extension: On systems where EVFILT_TIMER only has millisecond
+ * (or tick) resolution, arm the kernel timer slightly early and spin for the
+ * remaining time when reading. No-op where microsecond timers are available.
+ */
+#define TFD_PRECISE (1 << 30)
+
+/*
+ * epoll-shim extension: The timerfd is only ever used by one thread at a
+ * time, so its internal locking is skipped.
+ */
+#define TFD_SINGLE_THREADED (1 << 29)
+
 struct itimerspec;
 
 int timerfd_create(int, int);
 int timerfd_settime(int, int, const struct itimerspec *, struct itimerspec *);
 int timerfd_gettime(int, struct itimerspec *);
 
+/*
+ * epoll-shim extension: Re-arm many timerfds at once. The clock is sampled
+ * only once per batch. Per-entry error codes are stored in 'errs' (if not
+ * NULL). Returns -1 with errno set to the first error if any entry failed.
+ */
+struct timerfd_settime_entry {
+	int fd;
+	int flags;
+	struct itimerspec v;
+};
+
+int timerfd_settime_many(struct timerfd_settime_entry const *, size_t,
+    int * /*errs*/);
+
+/* epoll-shim extension: See <sys/epoll.h>. */
+#ifndef SHIM_SYS_SHIM_HANDLE
+#define SHIM_SYS_SHIM_HANDLE
+struct epoll_shim_handle;
+extern struct epoll_shim_handle *epoll_shim_handle_get(int);
+extern void epoll_shim_handle_put(struct epoll_shim_handle *);
+#endif
+
+int timerfd_settime_h(struct epoll_shim_handle *, int,
+    const struct itimerspec *, struct itimerspec *);
+
 
 #ifndef SHIM_SYS_SHIM_HELPERS
 #define SHIM_SYS_SHIM_HELPERS
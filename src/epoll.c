@@ -44,8 +44,27 @@ static FDContextVTable const epollfd_vtable = {
     .close_fun = epollfd_close,
 };
 
+/* Looks up 'fd', unless a 'handle' is given. */
+static errno_t
+epollfd_node_get(int fd, struct epoll_shim_handle *handle,
+    FDContextMapNode **node)
+{
+	if (handle) {
+		*node = (FDContextMapNode *)handle;
+		return (*node)->vtable == &epollfd_vtable ? 0 : EINVAL;
+	}
+
+	*node = epoll_shim_ctx_find_node(&epoll_shim_ctx, fd);
+	if (!*node || (*node)->vtable != &epollfd_vtable) {
+		struct stat sb;
+		return (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+	}
+
+	return 0;
+}
+
 static FDContextMapNode *
-epoll_create_impl(errno_t *ec)
+epoll_create_impl(int flags, errno_t *ec)
 {
 	FDContextMapNode *node;
 
@@ -56,12 +75,24 @@ epoll_create_impl(errno_t *ec)
 
 	node->flags = 0;
 
-	if ((*ec = epollfd_ctx_init(&node->ctx.epollfd, /**/
-		 node->fd)) != 0) {
+	int ctx_flags = 0;
+	if (flags & EPOLL_POLLER_THREAD) {
+		ctx_flags |= EPOLLFD_CTX_FLAG_POLLER_THREAD;
+	}
+	if (flags & EPOLL_SHARDED) {
+		ctx_flags |= EPOLLFD_CTX_FLAG_SHARDED;
+	}
+	if (flags & EPOLL_SINGLE_THREADED) {
+		ctx_flags |= EPOLLFD_CTX_FLAG_SINGLE_THREADED;
+	}
+
+	if ((*ec = epollfd_ctx_init(&node->ctx.epollfd, node->fd,
+		 ctx_flags)) != 0) {
 		goto fail;
 	}
 
 	node->vtable = &epollfd_vtable;
+	epoll_shim_ctx_add_epoll_node(&epoll_shim_ctx, node);
 	return node;
 
 fail:
@@ -71,12 +102,12 @@ fail:
 }
 
 static int
-epoll_create_common(void)
+epoll_create_common(int flags)
 {
 	FDContextMapNode *node;
 	errno_t ec;
 
-	node = epoll_create_impl(&ec);
+	node = epoll_create_impl(flags, &ec);
 	if (!node) {
 		errno = ec;
 		return -1;
@@ -93,40 +124,114 @@ epoll_create(int size)
 		return -1;
 	}
 
-	return epoll_create_common();
+	return epoll_create_common(0);
 }
 
 int
 epoll_create1(int flags)
 {
-	if (flags & ~EPOLL_CLOEXEC) {
+	if (flags &
+	    ~(EPOLL_CLOEXEC | EPOLL_POLLER_THREAD | EPOLL_SHARDED |
+		EPOLL_SINGLE_THREADED)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	return epoll_create_common();
+	return epoll_create_common(flags);
 }
 
 static errno_t
-epoll_ctl_impl(int fd, int op, int fd2, struct epoll_event *ev)
+epoll_ctl_impl(int fd, struct epoll_shim_handle *handle, int op, int fd2,
+    struct epoll_event *ev, struct epoll_lowat const *lowat)
 {
 	if (!ev && op != EPOLL_CTL_DEL) {
 		return EFAULT;
 	}
 
-	FDContextMapNode *node = epoll_shim_ctx_find_node(&epoll_shim_ctx, fd);
-	if (!node || node->vtable != &epollfd_vtable) {
-		struct stat sb;
-		return (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+	FDContextMapNode *node;
+	errno_t ec;
+	if ((ec = epollfd_node_get(fd, handle, &node)) != 0) {
+		return ec;
+	}
+
+	/* Keeps a shimmed 'fd2' alive while it is being registered. */
+	FDContextMapNode *fd2_node = NULL;
+	EventFDCtx *fd2_eventfd = NULL;
+	FDContextMapNode *fd2_consume_node = NULL;
+	if (op == EPOLL_CTL_ADD ||
+	    (op == EPOLL_CTL_MOD && (ev->events & EPOLLCONSUME))) {
+		fd2_node = epoll_shim_ctx_ref_node(&epoll_shim_ctx, fd2);
+
+		/* Only fds with a counter can be consumed. */
+		if ((ev->events & EPOLLCONSUME) &&
+		    (!fd2_node || !fd2_node->vtable->consume_fun)) {
+			ec = EINVAL;
+			goto out;
+		}
+
+		if (fd2_node && op == EPOLL_CTL_ADD) {
+			fd2_eventfd = fd_context_map_node_eventfd(fd2_node);
+		}
+		if (ev->events & EPOLLCONSUME) {
+			fd2_consume_node = fd2_node;
+		}
 	}
 
-	return epollfd_ctx_ctl(&node->ctx.epollfd, op, fd2, ev);
+	ec = epollfd_ctx_ctl(&node->ctx.epollfd, op, fd2, ev, lowat,
+	    fd2_eventfd, fd2_consume_node);
+
+out:
+	if (fd2_node) {
+		(void)fd_context_map_node_unref(fd2_node);
+	}
+	return ec;
 }
 
 int
 epoll_ctl(int fd, int op, int fd2, struct epoll_event *ev)
 {
-	errno_t ec = epoll_ctl_impl(fd, op, fd2, ev);
+	errno_t ec = epoll_ctl_impl(fd, NULL, op, fd2, ev, NULL);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+epoll_ctl_ex(int fd, int op, int fd2, struct epoll_event *ev,
+    struct epoll_lowat const *lowat)
+{
+	errno_t ec = epoll_ctl_impl(fd, NULL, op, fd2, ev, lowat);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+epoll_evictions(int fd, unsigned long *count)
+{
+	FDContextMapNode *node;
+
+	errno_t ec = epollfd_node_get(fd, NULL, &node);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	*count = epollfd_ctx_nr_evictions(&node->ctx.epollfd);
+	return 0;
+}
+
+int
+epoll_ctl_h(struct epoll_shim_handle *handle, int op, int fd2,
+    struct epoll_event *ev)
+{
+	errno_t ec = epoll_ctl_impl(-1, handle, op, fd2, ev, NULL);
 	if (ec != 0) {
 		errno = ec;
 		return -1;
@@ -141,18 +246,63 @@ is_no_wait_deadline(struct timespec const *deadline)
 	return (deadline && deadline->tv_sec == 0 && deadline->tv_nsec == 0);
 }
 
+/*
+ * Reads the counters of EPOLLCONSUME events through the references handed
+ * out by the wait, so no lookup is needed. Events whose counter was already
+ * consumed by someone else lose their EPOLLIN bit and are dropped if
+ * nothing else remains.
+ */
+static int
+epoll_consume_events(struct epoll_event_ex *ev, int cnt)
+{
+	int j = 0;
+
+	for (int i = 0; i < cnt; ++i) {
+		if (ev[i].events & EPOLLCONSUME) {
+			FDContextMapNode *node =
+			    (FDContextMapNode *)(uintptr_t)ev[i].value;
+
+			ev[i].events &= ~EPOLLCONSUME;
+			ev[i].value = 0;
+
+			errno_t ec = node->vtable->consume_fun(node,
+			    &ev[i].value);
+			(void)fd_context_map_node_unref(node);
+
+			if (ec != 0) {
+				ev[i].events &= ~(uint32_t)EPOLLIN;
+				if (!ev[i].events) {
+					continue;
+				}
+			}
+		}
+
+		ev[j++] = ev[i];
+	}
+
+	return j;
+}
+
 static errno_t
-epollfd_ctx_wait_or_block(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
-    int *actual_cnt, struct timespec const *deadline, sigset_t const *sigs)
+epollfd_ctx_wait_or_block(EpollFDCtx *epollfd, struct epoll_event *ev,
+    struct epoll_event_ex *ev_ex, int cnt, int *actual_cnt,
+    struct timespec const *deadline, sigset_t const *sigs)
 {
 	errno_t ec;
 
 	for (;;) {
 		if ((ec = epollfd_ctx_wait(epollfd, /**/
-			 ev, cnt, actual_cnt)) != 0) {
+			 ev, ev_ex, cnt, actual_cnt)) != 0) {
 			return ec;
 		}
 
+		if (ev_ex && *actual_cnt) {
+			*actual_cnt = epoll_consume_events(ev_ex, *actual_cnt);
+			if (!*actual_cnt) {
+				continue;
+			}
+		}
+
 		if (*actual_cnt || is_no_wait_deadline(deadline)) {
 			return 0;
 		}
@@ -174,32 +324,19 @@ epollfd_ctx_wait_or_block(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
 			}
 		}
 
-		(void)pthread_mutex_lock(&epollfd->mutex);
-
-		nfds_t nfds = (nfds_t)(1 + epollfd->poll_fds_size);
-
-		size_t size;
-		if (__builtin_mul_overflow(nfds, sizeof(struct pollfd),
-			&size)) {
-			ec = ENOMEM;
-			(void)pthread_mutex_unlock(&epollfd->mutex);
-			return ec;
-		}
+		shim_mutex_lock(&epollfd->mutex);
 
-		struct pollfd *pfds = malloc(size);
-		if (!pfds) {
-			ec = errno;
-			(void)pthread_mutex_unlock(&epollfd->mutex);
+		struct pollfd *pfds;
+		size_t nfds;
+		if ((ec = epollfd_ctx_blocking_pollfds(epollfd, /**/
+			 &pfds, &nfds)) != 0) {
+			shim_mutex_unlock(&epollfd->mutex);
 			return ec;
 		}
 
-		epollfd_ctx_fill_pollfds(epollfd, pfds);
+		unsigned long generation = epollfd_ctx_begin_polling(epollfd);
 
-		(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-		++epollfd->nr_polling_threads;
-		(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
-
-		(void)pthread_mutex_unlock(&epollfd->mutex);
+		shim_mutex_unlock(&epollfd->mutex);
 
 		/*
 		 * This surfaced a race condition when
@@ -210,20 +347,13 @@ epollfd_ctx_wait_or_block(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
 		usleep(500000);
 #endif
 
-		int n = ppoll(pfds, nfds, deadline ? &timeout : NULL, sigs);
+		int n = ppoll(pfds, (nfds_t)nfds, deadline ? &timeout : NULL,
+		    sigs);
 		if (n < 0) {
 			ec = errno;
 		}
 
-		free(pfds);
-
-		(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-		--epollfd->nr_polling_threads;
-		if (epollfd->nr_polling_threads == 0) {
-			(void)pthread_cond_signal(
-			    &epollfd->nr_polling_threads_cond);
-		}
-		(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
+		epollfd_ctx_end_polling(epollfd, generation);
 
 		if (n < 0) {
 			return ec;
@@ -260,26 +390,28 @@ timeout_to_deadline(struct timespec *deadline, int to)
 }
 
 static errno_t
-epoll_pwait_impl(int fd, struct epoll_event *ev, int cnt, int to,
+epoll_pwait_impl(int fd, struct epoll_shim_handle *handle,
+    struct epoll_event *ev, struct epoll_event_ex *ev_ex, int cnt, int to,
     sigset_t const *sigs, int *actual_cnt)
 {
-	if (cnt < 1 || cnt > (int)(INT_MAX / sizeof(struct epoll_event))) {
+	if (cnt < 1 ||
+	    cnt > (int)(INT_MAX / (ev_ex ? sizeof(struct epoll_event_ex)
+					 : sizeof(struct epoll_event)))) {
 		return EINVAL;
 	}
 
-	FDContextMapNode *node = epoll_shim_ctx_find_node(&epoll_shim_ctx, fd);
-	if (!node || node->vtable != &epollfd_vtable) {
-		struct stat sb;
-		return (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+	FDContextMapNode *node;
+	errno_t ec;
+	if ((ec = epollfd_node_get(fd, handle, &node)) != 0) {
+		return ec;
 	}
 
 	struct timespec deadline;
-	errno_t ec;
 	if (to >= 0 && (ec = timeout_to_deadline(&deadline, to)) != 0) {
 		return ec;
 	}
 
-	return epollfd_ctx_wait_or_block(&node->ctx.epollfd, ev, cnt,
+	return epollfd_ctx_wait_or_block(&node->ctx.epollfd, ev, ev_ex, cnt,
 	    actual_cnt, (to >= 0) ? &deadline : NULL, sigs);
 }
 
@@ -289,7 +421,8 @@ epoll_pwait(int fd, struct epoll_event *ev, int cnt, int to,
 {
 	int actual_cnt;
 
-	errno_t ec = epoll_pwait_impl(fd, ev, cnt, to, sigs, &actual_cnt);
+	errno_t ec = epoll_pwait_impl(fd, NULL, ev, NULL, cnt, to, sigs,
+	    &actual_cnt);
 	if (ec != 0) {
 		errno = ec;
 		return -1;
@@ -303,3 +436,34 @@ epoll_wait(int fd, struct epoll_event *ev, int cnt, int to)
 {
 	return epoll_pwait(fd, ev, cnt, to, NULL);
 }
+
+int
+epoll_wait_ex(int fd, struct epoll_event_ex *ev, int cnt, int to)
+{
+	int actual_cnt;
+
+	errno_t ec = epoll_pwait_impl(fd, NULL, NULL, ev, cnt, to, NULL,
+	    &actual_cnt);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return actual_cnt;
+}
+
+int
+epoll_wait_h(struct epoll_shim_handle *handle, struct epoll_event *ev,
+    int cnt, int to)
+{
+	int actual_cnt;
+
+	errno_t ec = epoll_pwait_impl(-1, handle, ev, NULL, cnt, to, NULL,
+	    &actual_cnt);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return actual_cnt;
+}
@@ -1,15 +1,20 @@
 #include "epoll_shim_ctx.h"
 
 #include <sys/event.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 
+#include "kernel_caps.h"
+
 static void
 fd_context_map_node_init(FDContextMapNode *node, int kq)
 {
+	atomic_init(&node->refcount, 1);
+	node->is_on_epoll_list = false;
 	node->fd = kq;
 	node->vtable = NULL;
 }
@@ -34,7 +39,7 @@ fd_context_map_node_terminate(FDContextMapNode *node, bool close_fd)
 {
 	errno_t ec = node->vtable ? node->vtable->close_fun(node) : 0;
 
-	if (close_fd && close(node->fd) < 0) {
+	if (close_fd && node->fd >= 0 && close(node->fd) < 0) {
 		ec = ec ? ec : errno;
 	}
 
@@ -49,6 +54,23 @@ fd_context_map_node_destroy(FDContextMapNode *node)
 	return ec;
 }
 
+void
+fd_context_map_node_ref(FDContextMapNode *node)
+{
+	atomic_fetch_add_explicit(&node->refcount, 1, memory_order_relaxed);
+}
+
+errno_t
+fd_context_map_node_unref(FDContextMapNode *node)
+{
+	if (atomic_fetch_sub_explicit(&node->refcount, 1,
+		memory_order_acq_rel) != 1) {
+		return 0;
+	}
+
+	return fd_context_map_node_destroy(node);
+}
+
 /**/
 
 errno_t
@@ -90,9 +112,41 @@ RB_GENERATE_STATIC(fd_context_map_, fd_context_map_node_, entry,
 
 EpollShimCtx epoll_shim_ctx = {
     .fd_context_map = RB_INITIALIZER(&fd_context_map),
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .epoll_nodes = LIST_HEAD_INITIALIZER(&epoll_nodes),
+    .mutex = SHIM_MUTEX_INITIALIZER,
 };
 
+static atomic_uint *
+epoll_shim_ctx_fd_bucket(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	return &epoll_shim_ctx->nr_nodes_by_fd_bucket[(unsigned int)fd %
+	    EPOLL_SHIM_CTX_NR_FD_BUCKETS];
+}
+
+/* Tells without locking whether there may be a node for 'fd'. */
+static bool
+epoll_shim_ctx_may_have_node(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	return fd >= 0 &&
+	    atomic_load_explicit(epoll_shim_ctx_fd_bucket(epoll_shim_ctx, fd),
+		memory_order_relaxed) != 0;
+}
+
+static void
+epoll_shim_ctx_unlink_node_locked(EpollShimCtx *epoll_shim_ctx,
+    FDContextMapNode *node)
+{
+	RB_REMOVE(fd_context_map_, &epoll_shim_ctx->fd_context_map, node);
+	atomic_fetch_sub_explicit(epoll_shim_ctx_fd_bucket(epoll_shim_ctx,
+				      node->fd),
+	    1, memory_order_relaxed);
+
+	if (node->is_on_epoll_list) {
+		LIST_REMOVE(node, epoll_entry);
+		node->is_on_epoll_list = false;
+	}
+}
+
 static FDContextMapNode *
 epoll_shim_ctx_create_node_impl(EpollShimCtx *epoll_shim_ctx, int kq,
     errno_t *ec)
@@ -116,20 +170,43 @@ epoll_shim_ctx_create_node_impl(EpollShimCtx *epoll_shim_ctx, int kq,
 		 * must not close it, but we must clean up the old context
 		 * object!
 		 */
-		(void)fd_context_map_node_terminate(node, false);
-		fd_context_map_node_init(node, kq);
-	} else {
-		node = fd_context_map_node_create(kq, ec);
-		if (!node) {
-			return NULL;
+		if (node->is_on_epoll_list) {
+			LIST_REMOVE(node, epoll_entry);
 		}
 
-		void *colliding_node = RB_INSERT(fd_context_map_,
+		if (atomic_load(&node->refcount) == 1) {
+			(void)fd_context_map_node_terminate(node, false);
+			fd_context_map_node_init(node, kq);
+			return node;
+		}
+
+		/*
+		 * Handles to the old context still exist, so it is cleaned
+		 * up when the last of them is put. The node does not own
+		 * any fd from now on.
+		 */
+		RB_REMOVE(fd_context_map_, /**/
 		    &epoll_shim_ctx->fd_context_map, node);
-		(void)colliding_node;
-		assert(colliding_node == NULL);
+		atomic_fetch_sub_explicit(epoll_shim_ctx_fd_bucket(
+					      epoll_shim_ctx, kq),
+		    1, memory_order_relaxed);
+		node->is_on_epoll_list = false;
+		node->fd = -1;
+		(void)fd_context_map_node_unref(node);
 	}
 
+	node = fd_context_map_node_create(kq, ec);
+	if (!node) {
+		return NULL;
+	}
+
+	void *colliding_node = RB_INSERT(fd_context_map_,
+	    &epoll_shim_ctx->fd_context_map, node);
+	(void)colliding_node;
+	assert(colliding_node == NULL);
+	atomic_fetch_add_explicit(epoll_shim_ctx_fd_bucket(epoll_shim_ctx, kq),
+	    1, memory_order_relaxed);
+
 	return node;
 }
 
@@ -138,15 +215,17 @@ epoll_shim_ctx_create_node(EpollShimCtx *epoll_shim_ctx, errno_t *ec)
 {
 	FDContextMapNode *node;
 
+	kernel_caps_probe();
+
 	int kq = kqueue();
 	if (kq < 0) {
 		*ec = errno;
 		return NULL;
 	}
 
-	(void)pthread_mutex_lock(&epoll_shim_ctx->mutex);
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
 	node = epoll_shim_ctx_create_node_impl(epoll_shim_ctx, kq, ec);
-	(void)pthread_mutex_unlock(&epoll_shim_ctx->mutex);
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
 
 	if (!node) {
 		close(kq);
@@ -174,25 +253,63 @@ epoll_shim_ctx_find_node(EpollShimCtx *epoll_shim_ctx, int fd)
 {
 	FDContextMapNode *node;
 
-	(void)pthread_mutex_lock(&epoll_shim_ctx->mutex);
+	if (!epoll_shim_ctx_may_have_node(epoll_shim_ctx, fd)) {
+		return NULL;
+	}
+
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
 	node = epoll_shim_ctx_find_node_impl(epoll_shim_ctx, fd);
-	(void)pthread_mutex_unlock(&epoll_shim_ctx->mutex);
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
 
 	return node;
 }
 
+FDContextMapNode *
+epoll_shim_ctx_ref_node(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	FDContextMapNode *node;
+
+	if (!epoll_shim_ctx_may_have_node(epoll_shim_ctx, fd)) {
+		return NULL;
+	}
+
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
+	node = epoll_shim_ctx_find_node_impl(epoll_shim_ctx, fd);
+	if (node) {
+		fd_context_map_node_ref(node);
+	}
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
+
+	return node;
+}
+
+void
+epoll_shim_ctx_ref_nodes(EpollShimCtx *epoll_shim_ctx, int const *fds,
+    size_t n, FDContextMapNode **nodes)
+{
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
+	for (size_t i = 0; i < n; ++i) {
+		nodes[i] = epoll_shim_ctx_may_have_node(epoll_shim_ctx, fds[i])
+		    ? epoll_shim_ctx_find_node_impl(epoll_shim_ctx, fds[i])
+		    : NULL;
+		if (nodes[i]) {
+			fd_context_map_node_ref(nodes[i]);
+		}
+	}
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
+}
+
 FDContextMapNode *
 epoll_shim_ctx_remove_node(EpollShimCtx *epoll_shim_ctx, int fd)
 {
 	FDContextMapNode *node;
 
-	(void)pthread_mutex_lock(&epoll_shim_ctx->mutex);
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
 	node = epoll_shim_ctx_find_node_impl(epoll_shim_ctx, fd);
 	if (node) {
-		RB_REMOVE(fd_context_map_, /**/
-		    &epoll_shim_ctx->fd_context_map, node);
+		epoll_shim_ctx_unlink_node_locked(epoll_shim_ctx, node);
 	}
-	(void)pthread_mutex_unlock(&epoll_shim_ctx->mutex);
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
 
 	return node;
 }
@@ -201,10 +318,42 @@ void
 epoll_shim_ctx_remove_node_explicit(EpollShimCtx *epoll_shim_ctx,
     FDContextMapNode *node)
 {
-	(void)pthread_mutex_lock(&epoll_shim_ctx->mutex);
-	RB_REMOVE(fd_context_map_, /**/
-	    &epoll_shim_ctx->fd_context_map, node);
-	(void)pthread_mutex_unlock(&epoll_shim_ctx->mutex);
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
+	epoll_shim_ctx_unlink_node_locked(epoll_shim_ctx, node);
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
+}
+
+void
+epoll_shim_ctx_add_epoll_node(EpollShimCtx *epoll_shim_ctx,
+    FDContextMapNode *node)
+{
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
+	assert(!node->is_on_epoll_list);
+	LIST_INSERT_HEAD(&epoll_shim_ctx->epoll_nodes, node, epoll_entry);
+	node->is_on_epoll_list = true;
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
+}
+
+void
+epoll_shim_ctx_evict_fd(EpollShimCtx *epoll_shim_ctx, int fd)
+{
+	FDContextMapNode *node;
+
+	/* Closing an fd that no epoll instance has takes no lock. */
+	if (!epollfd_ctx_may_be_registered(fd)) {
+		return;
+	}
+
+	/*
+	 * Lock order is global mutex before epoll mutex. Nothing may take
+	 * the global mutex while holding an epoll mutex.
+	 */
+	shim_mutex_lock(&epoll_shim_ctx->mutex);
+	LIST_FOREACH(node, &epoll_shim_ctx->epoll_nodes, epoll_entry)
+	{
+		epollfd_ctx_evict_fd(&node->ctx.epollfd, fd);
+	}
+	shim_mutex_unlock(&epoll_shim_ctx->mutex);
 }
 
 /**/
@@ -214,12 +363,19 @@ epoll_shim_close(int fd)
 {
 	FDContextMapNode *node;
 
+	/* kqueue drops the knotes on close, drop the registrations, too. */
+	epoll_shim_ctx_evict_fd(&epoll_shim_ctx, fd);
+
 	node = epoll_shim_ctx_remove_node(&epoll_shim_ctx, fd);
 	if (!node) {
 		return close(fd);
 	}
 
-	errno_t ec = fd_context_map_node_destroy(node);
+	/*
+	 * The context may still be used through handles and needs its kq.
+	 * In that case, the fd is only closed when the last handle is put.
+	 */
+	errno_t ec = fd_context_map_node_unref(node);
 	if (ec != 0) {
 		errno = ec;
 		return -1;
@@ -228,6 +384,27 @@ epoll_shim_close(int fd)
 	return 0;
 }
 
+struct epoll_shim_handle *
+epoll_shim_handle_get(int fd)
+{
+	FDContextMapNode *node = epoll_shim_ctx_ref_node(&epoll_shim_ctx, fd);
+	if (!node) {
+		struct stat sb;
+		errno = (fd < 0 || fstat(fd, &sb) < 0) ? EBADF : EINVAL;
+		return NULL;
+	}
+
+	return (struct epoll_shim_handle *)node;
+}
+
+void
+epoll_shim_handle_put(struct epoll_shim_handle *handle)
+{
+	if (handle) {
+		(void)fd_context_map_node_unref((FDContextMapNode *)handle);
+	}
+}
+
 ssize_t
 epoll_shim_read(int fd, void *buf, size_t nbytes)
 {
@@ -279,3 +456,35 @@ epoll_shim_write(int fd, void const *buf, size_t nbytes)
 
 	return (ssize_t)bytes_transferred;
 }
+
+unsigned int
+epoll_shim_kernel_caps(void)
+{
+	unsigned int caps = 0;
+
+	kernel_caps_probe();
+
+	if (kernel_caps.has_evfilt_user) {
+		caps |= EPOLL_SHIM_CAP_EVFILT_USER;
+	}
+	if (kernel_caps.has_evfilt_except) {
+		caps |= EPOLL_SHIM_CAP_EVFILT_EXCEPT;
+	}
+	if (kernel_caps.has_note_useconds) {
+		caps |= EPOLL_SHIM_CAP_NOTE_USECONDS;
+	}
+	if (kernel_caps.has_zero_timer) {
+		caps |= EPOLL_SHIM_CAP_ZERO_TIMER;
+	}
+	if (kernel_caps.has_quirky_evfilt_timer) {
+		caps |= EPOLL_SHIM_CAP_QUIRKY_EVFILT_TIMER;
+	}
+	int fifo_no_reader_error = kernel_caps_fifo_no_reader_error();
+	if (fifo_no_reader_error == EPIPE) {
+		caps |= EPOLL_SHIM_CAP_FIFO_EPIPE;
+	} else if (fifo_no_reader_error == EBADF) {
+		caps |= EPOLL_SHIM_CAP_FIFO_EBADF;
+	}
+
+	return caps;
+}
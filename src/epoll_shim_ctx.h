@@ -3,6 +3,7 @@
 
 #include <sys/tree.h>
 
+#include <stdatomic.h>
 #include <unistd.h>
 
 #include "epollfd_ctx.h"
@@ -18,11 +19,15 @@ typedef errno_t (*fd_context_read_fun)(FDContextMapNode *node, /**/
 typedef errno_t (*fd_context_write_fun)(FDContextMapNode *node, /**/
     const void *buf, size_t nbytes, size_t *bytes_transferred);
 typedef errno_t (*fd_context_close_fun)(FDContextMapNode *node);
+/* Non-blocking read of the counter, for EPOLLCONSUME. */
+typedef errno_t (*fd_context_consume_fun)(FDContextMapNode *node, /**/
+    uint64_t *value);
 
 typedef struct {
 	fd_context_read_fun read_fun;
 	fd_context_write_fun write_fun;
 	fd_context_close_fun close_fun;
+	fd_context_consume_fun consume_fun;
 } FDContextVTable;
 
 errno_t fd_context_default_read(FDContextMapNode *node, /**/
@@ -32,6 +37,9 @@ errno_t fd_context_default_write(FDContextMapNode *node, /**/
 
 struct fd_context_map_node_ {
 	RB_ENTRY(fd_context_map_node_) entry;
+	LIST_ENTRY(fd_context_map_node_) epoll_entry;
+	bool is_on_epoll_list;
+	atomic_uint refcount; /* One for the map, one per handle. */
 	int fd;
 	int flags;
 	union {
@@ -44,14 +52,29 @@ struct fd_context_map_node_ {
 };
 
 errno_t fd_context_map_node_destroy(FDContextMapNode *node);
+void fd_context_map_node_ref(FDContextMapNode *node);
+/* Destroys the node when the last reference is gone. */
+errno_t fd_context_map_node_unref(FDContextMapNode *node);
+
+/* Returns NULL if 'node' is not an eventfd. */
+EventFDCtx *fd_context_map_node_eventfd(FDContextMapNode *node);
 
 /**/
 
 typedef RB_HEAD(fd_context_map_, fd_context_map_node_) FDContextMap;
 
+#define EPOLL_SHIM_CTX_NR_FD_BUCKETS 1024
+
 typedef struct {
 	FDContextMap fd_context_map;
-	pthread_mutex_t mutex;
+	LIST_HEAD(epoll_nodes_, fd_context_map_node_) epoll_nodes;
+	ShimMutex mutex;
+
+	/*
+	 * Number of nodes in the map per fd bucket. Lookups of fds whose
+	 * bucket is empty cannot succeed and skip the mutex.
+	 */
+	atomic_uint nr_nodes_by_fd_bucket[EPOLL_SHIM_CTX_NR_FD_BUCKETS];
 } EpollShimCtx;
 
 extern EpollShimCtx epoll_shim_ctx;
@@ -60,11 +83,25 @@ FDContextMapNode *epoll_shim_ctx_create_node(EpollShimCtx *epoll_shim_ctx,
     errno_t *ec);
 FDContextMapNode *epoll_shim_ctx_find_node(EpollShimCtx *epoll_shim_ctx,
     int fd);
+/* Like 'epoll_shim_ctx_find_node', but returns a new reference. */
+FDContextMapNode *epoll_shim_ctx_ref_node(EpollShimCtx *epoll_shim_ctx,
+    int fd);
+/* Looks up 'n' fds under a single acquisition of the global mutex. */
+void epoll_shim_ctx_ref_nodes(EpollShimCtx *epoll_shim_ctx, int const *fds,
+    size_t n, FDContextMapNode **nodes);
 FDContextMapNode *epoll_shim_ctx_remove_node(EpollShimCtx *epoll_shim_ctx,
     int fd);
 void epoll_shim_ctx_remove_node_explicit(EpollShimCtx *epoll_shim_ctx,
     FDContextMapNode *node);
 
+/*
+ * Epoll nodes are tracked so that registrations of fds closed through
+ * 'epoll_shim_close' can be evicted from every epoll instance.
+ */
+void epoll_shim_ctx_add_epoll_node(EpollShimCtx *epoll_shim_ctx,
+    FDContextMapNode *node);
+void epoll_shim_ctx_evict_fd(EpollShimCtx *epoll_shim_ctx, int fd);
+
 /**/
 
 int epoll_shim_close(int fd);
@@ -11,11 +11,6 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 
-#if defined(__DragonFly__)
-/* For TAILQ_FOREACH_SAFE. */
-#include <netproto/802_11/ieee80211_dragonfly.h>
-#endif
-
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -23,8 +18,19 @@
 
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include "epoll_shim_ctx.h"
+#include "kernel_caps.h"
+
+/* Headers may offer EVFILT_EXCEPT even if the running kernel does not. */
+#ifdef EVFILT_EXCEPT
+#define HAS_EVFILT_EXCEPT (kernel_caps.has_evfilt_except)
+#else
+#define HAS_EVFILT_EXCEPT false
+#endif
+
 static RegisteredFDsNode *
 registered_fds_node_create(int fd)
 {
@@ -35,7 +41,11 @@ registered_fds_node_create(int fd)
 		return NULL;
 	}
 
-	*node = (RegisteredFDsNode){.fd = fd, .self_pipe = {-1, -1}};
+	*node = (RegisteredFDsNode){
+	    .fd = fd,
+	    .revents_nreadable = -1,
+	    .revents_nwritable = -1,
+	};
 
 	return node;
 }
@@ -43,9 +53,12 @@ registered_fds_node_create(int fd)
 static void
 registered_fds_node_destroy(RegisteredFDsNode *node)
 {
-	if (node->self_pipe[0] >= 0 && node->self_pipe[1] >= 0) {
-		(void)close(node->self_pipe[0]);
-		(void)close(node->self_pipe[1]);
+	if (node->node_type == NODE_TYPE_EVENTFD) {
+		eventfd_watch_release(node->node_data.eventfd.watch);
+	}
+
+	if (node->consume_node) {
+		(void)fd_context_map_node_unref(node->consume_node);
 	}
 
 	free(node);
@@ -126,15 +139,14 @@ get_needed_filters(RegisteredFDsNode *fd2_node)
 			    : EV_CLEAR;
 		}
 
-#ifdef EVFILT_EXCEPT
-		needed_filters.evfilt_except = !!(fd2_node->events & EPOLLPRI);
-#else
-		if (needed_filters.evfilt_read == 0 &&
+		if (HAS_EVFILT_EXCEPT) {
+			needed_filters.evfilt_except =
+			    !!(fd2_node->events & EPOLLPRI);
+		} else if (needed_filters.evfilt_read == 0 &&
 		    (fd2_node->events & EPOLLPRI)) {
 			needed_filters.evfilt_read =
 			    fd2_node->pollpri_active ? 1 : EV_CLEAR;
 		}
-#endif
 
 		needed_filters.evfilt_write = !!(fd2_node->events & EPOLLOUT);
 
@@ -210,53 +222,126 @@ out:
 	return needed_filters;
 }
 
+static unsigned
+lowat_fflags(int lowat)
+{
+#ifdef NOTE_LOWAT
+	return lowat > 0 ? NOTE_LOWAT : 0;
+#else
+	assert(lowat == 0);
+	return 0;
+#endif
+}
+
 static void
 registered_fds_node_update_flags_from_epoll_event(RegisteredFDsNode *fd2_node,
-    struct epoll_event *ev)
+    struct epoll_event *ev, struct epoll_lowat const *lowat,
+    FDContextMapNode *fd2_consume_node)
 {
+	fd2_node->rcvlowat = lowat ? lowat->rcvlowat : 0;
+	fd2_node->sndlowat = lowat ? lowat->sndlowat : 0;
+
 	fd2_node->events =
 	    ev->events & (EPOLLIN | EPOLLPRI | EPOLLRDHUP | EPOLLOUT);
 	fd2_node->data = ev->data;
 	fd2_node->is_edge_triggered = ev->events & EPOLLET;
 	fd2_node->is_oneshot = ev->events & EPOLLONESHOT;
 
+	FDContextMapNode *consume_node = NULL;
+	if (ev->events & EPOLLCONSUME) {
+		assert(fd2_consume_node != NULL);
+		consume_node = fd2_consume_node;
+		fd_context_map_node_ref(consume_node);
+	}
+	if (fd2_node->consume_node) {
+		(void)fd_context_map_node_unref(fd2_node->consume_node);
+	}
+	fd2_node->consume_node = consume_node;
+
 	if (fd2_node->is_oneshot) {
 		fd2_node->is_edge_triggered = true;
 	}
 }
 
+/*
+ * EPOLLONESHOT is mapped to EV_DISPATCH for node types whose knotes are
+ * plain EVFILT_READ/EVFILT_WRITE/EVFILT_EXCEPT filters. After delivery the
+ * knotes are only disabled, and re-arming is a single kevent call.
+ */
+static unsigned short
+registered_fds_node_dispatch_flag(RegisteredFDsNode *fd2_node)
+{
+#ifdef EV_DISPATCH
+	if (fd2_node->is_oneshot &&
+	    (fd2_node->node_type == NODE_TYPE_SOCKET ||
+		fd2_node->node_type == NODE_TYPE_KQUEUE ||
+		fd2_node->node_type == NODE_TYPE_OTHER)) {
+		return EV_DISPATCH;
+	}
+#else
+	(void)fd2_node;
+#endif
+	return 0;
+}
+
+static void
+registered_fds_node_sanitize_flags(RegisteredFDsNode *fd2_node)
+{
+	/* Only sockets support EPOLLRDHUP and EPOLLPRI. */
+	if (fd2_node->node_type != NODE_TYPE_SOCKET) {
+		fd2_node->events &= ~(uint32_t)EPOLLRDHUP;
+		fd2_node->events &= ~(uint32_t)EPOLLPRI;
+	}
+
+	/* Low-water marks only make sense for sockets and pipes. */
+	if (fd2_node->node_type != NODE_TYPE_SOCKET &&
+	    fd2_node->node_type != NODE_TYPE_FIFO) {
+		fd2_node->rcvlowat = 0;
+		fd2_node->sndlowat = 0;
+	}
+}
+
+static errno_t epollfd_ctx__add_self_trigger(EpollFDCtx *epollfd);
+static void epollfd_ctx__trigger_self(EpollFDCtx *epollfd);
+
+/* The kqueue holding the fd knotes of 'fd2_node'. */
+static int
+registered_fds_node_kq(RegisteredFDsNode const *fd2_node,
+    EpollFDCtx const *epollfd)
+{
+	if (epollfd->nr_shards == 0) {
+		return epollfd->kq;
+	}
+
+	return epollfd->shard_kqs[(unsigned)fd2_node->fd % epollfd->nr_shards];
+}
+
 static errno_t
 registered_fds_node_add_self_trigger(RegisteredFDsNode *fd2_node,
     EpollFDCtx *epollfd)
 {
+#ifdef EVFILT_USER
 	struct kevent kevs[1];
 
-#ifdef EVFILT_USER
 	EV_SET(&kevs[0], (uintptr_t)fd2_node, EVFILT_USER, /**/
 	    EV_ADD | EV_CLEAR, 0, 0, fd2_node);
-#else
-	if (fd2_node->self_pipe[0] < 0 && fd2_node->self_pipe[1] < 0) {
-		if (pipe2(fd2_node->self_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
-			errno_t ec = errno;
-			fd2_node->self_pipe[0] = fd2_node->self_pipe[1] = -1;
-			return ec;
-		}
-
-		assert(fd2_node->self_pipe[0] >= 0);
-		assert(fd2_node->self_pipe[1] >= 0);
-	}
-
-	EV_SET(&kevs[0], fd2_node->self_pipe[0], EVFILT_READ, /**/
-	    EV_ADD | EV_CLEAR, 0, 0, fd2_node);
-#endif
 
 	if (kevent(epollfd->kq, kevs, 1, NULL, 0, NULL) < 0) {
 		return errno;
 	}
 
 	return 0;
+#else
+	(void)fd2_node;
+	return epollfd_ctx__add_self_trigger(epollfd);
+#endif
 }
 
+/*
+ * Without EVFILT_USER, triggered nodes are queued and the epoll's self-pipe
+ * is written once for the whole batch. The harvest turns the queued nodes
+ * into kevents with the node as 'ident'.
+ */
 static void
 registered_fds_node_trigger_self(RegisteredFDsNode *fd2_node,
     EpollFDCtx *epollfd)
@@ -267,39 +352,129 @@ registered_fds_node_trigger_self(RegisteredFDsNode *fd2_node,
 	    0, NOTE_TRIGGER, 0, fd2_node);
 	(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
 #else
-	(void)epollfd;
-	assert(fd2_node->self_pipe[1] >= 0);
+	if (fd2_node->is_self_triggered) {
+		return;
+	}
 
-	char c = 0;
-	(void)write(fd2_node->self_pipe[1], &c, 1);
+	bool was_empty = TAILQ_EMPTY(&epollfd->triggered_nodes);
+
+	TAILQ_INSERT_TAIL(&epollfd->triggered_nodes, fd2_node, trigger_entry);
+	fd2_node->is_self_triggered = true;
+
+	if (was_empty) {
+		epollfd_ctx__trigger_self(epollfd);
+	}
+#endif
+}
+
+static void
+registered_fds_node_trigger_eventfd(RegisteredFDsNode *fd2_node,
+    EpollFDCtx *epollfd)
+{
+#ifdef EVFILT_USER
+	struct kevent kevs[1];
+	EV_SET(&kevs[0], (uintptr_t)fd2_node->node_data.eventfd.watch,
+	    EVFILT_USER, 0, NOTE_TRIGGER, 0, fd2_node);
+	(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
+#else
+	(void)fd2_node;
+	(void)epollfd;
+	assert(0);
 #endif
 }
 
+static void epollfd_ctx__update_pollfd(EpollFDCtx *epollfd,
+    RegisteredFDsNode *fd2_node);
+
+/*
+ * Returns the 'revents' of polling the fd for 'events', taken from the
+ * batched probe of 'epollfd_ctx__probe_nodes' if there is one.
+ */
+static short
+registered_fds_node_probe(RegisteredFDsNode *fd2_node, short events)
+{
+	if (fd2_node->has_probe_revents) {
+		fd2_node->has_probe_revents = false;
+		return fd2_node->probe_revents;
+	}
+
+	struct pollfd pfd = {
+	    .fd = fd2_node->fd,
+	    .events = events,
+	};
+
+	return poll(&pfd, 1, 0) < 0 ? POLLERR : pfd.revents;
+}
+
+/*
+ * Returns true if feeding 'kev' needs a poll probe of the fd, and which
+ * events to probe for.
+ */
+static bool
+registered_fds_node_needs_probe(RegisteredFDsNode *fd2_node,
+    struct kevent const *kev, short *events)
+{
+	if (fd2_node->node_type == NODE_TYPE_POLL) {
+		*events = (short)fd2_node->events;
+		return true;
+	}
+
+	if (!HAS_EVFILT_EXCEPT && fd2_node->node_type == NODE_TYPE_SOCKET &&
+	    kev->filter == EVFILT_READ && (fd2_node->events & EPOLLPRI)) {
+		*events = POLLPRI;
+		return true;
+	}
+
+	return false;
+}
+
 static void
 registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
     EpollFDCtx *epollfd, struct kevent const *kev)
 {
 	int revents = 0;
 
+	if (fd2_node->node_type == NODE_TYPE_EVENTFD) {
+#ifdef EVFILT_USER
+		assert(kev->filter == EVFILT_USER);
+#endif
+
+		/* The eventfd mirrors its readiness into the watch. */
+		EventFDWatch *watch = fd2_node->node_data.eventfd.watch;
+		if (atomic_load(&watch->is_readable)) {
+			revents |= EPOLLIN;
+		}
+
+		goto out;
+	}
+
 	if (fd2_node->node_type == NODE_TYPE_POLL) {
 		assert(fd2_node->revents == 0);
 
 #ifdef EVFILT_USER
 		assert(kev->filter == EVFILT_USER);
 #else
-		char c[32];
-		while (read(fd2_node->self_pipe[0], c, sizeof(c)) >= 0) {
-		}
+		assert(kev->ident == (uintptr_t)fd2_node);
 #endif
 
-		struct pollfd pfd = {
-		    .fd = fd2_node->fd,
-		    .events = (short)fd2_node->events,
-		};
+		revents = registered_fds_node_probe(fd2_node,
+		    (short)fd2_node->events);
+		if (revents & POLLNVAL) {
+			revents = 0;
+		}
 
-		revents = poll(&pfd, 1, 0) < 0 ? EPOLLERR : pfd.revents;
+		if (fd2_node->is_edge_triggered) {
+			/* Only report readiness that is new. */
+			uint32_t last_revents = fd2_node->poll_revents;
+			fd2_node->poll_revents = (uint32_t)revents;
+			revents &= ~(int)last_revents;
 
-		fd2_node->revents = revents & POLLNVAL ? 0 : (uint32_t)revents;
+			if (fd2_node->pollfd_index != 0) {
+				epollfd_ctx__update_pollfd(epollfd, fd2_node);
+			}
+		}
+
+		fd2_node->revents = (uint32_t)revents;
 		assert(!(fd2_node->revents &
 		    ~(uint32_t)(POLLIN | POLLOUT | POLLERR | POLLHUP)));
 		return;
@@ -309,8 +484,7 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
 #ifdef EVFILT_USER
 	    kev->filter == EVFILT_USER
 #else
-	    (fd2_node->self_pipe[0] >= 0 &&
-		kev->ident == (uintptr_t)fd2_node->self_pipe[0])
+	    kev->ident == (uintptr_t)fd2_node
 #endif
 	) {
 		assert(fd2_node->revents == 0);
@@ -326,9 +500,11 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
 		EV_SET(&nkev[0], fd2_node->fd, EVFILT_WRITE,
 		    EV_ADD | (needed_filters.evfilt_write & EV_CLEAR) |
 			EV_RECEIPT,
-		    0, 0, fd2_node);
+		    lowat_fflags(fd2_node->sndlowat), fd2_node->sndlowat,
+		    fd2_node);
 
-		if (kevent(epollfd->kq, nkev, 1, nkev, 1, NULL) != 1 ||
+		if (kevent(registered_fds_node_kq(fd2_node, epollfd), /**/
+			nkev, 1, nkev, 1, NULL) != 1 ||
 		    nkev[0].data != 0) {
 			revents = EPOLLERR | EPOLLOUT;
 
@@ -340,6 +516,8 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
 			goto out;
 		} else {
 			fd2_node->has_evfilt_write = true;
+			fd2_node->evfilt_write_flags = (unsigned short)( /**/
+			    needed_filters.evfilt_write & EV_CLEAR);
 			return;
 		}
 	}
@@ -354,22 +532,15 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
 
 	if (kev->filter == EVFILT_READ) {
 		revents |= EPOLLIN;
-#ifndef EVFILT_EXCEPT
-		if (fd2_node->events & EPOLLPRI) {
-			struct pollfd pfd = {
-			    .fd = fd2_node->fd,
-			    .events = POLLPRI,
-			};
-
-			if ((poll(&pfd, 1, 0) == 1) &&
-			    (pfd.revents & POLLPRI)) {
+		if (!HAS_EVFILT_EXCEPT && (fd2_node->events & EPOLLPRI)) {
+			if (registered_fds_node_probe(fd2_node, POLLPRI) &
+			    POLLPRI) {
 				revents |= EPOLLPRI;
 				fd2_node->pollpri_active = true;
 			} else {
 				fd2_node->pollpri_active = false;
 			}
 		}
-#endif
 	} else if (kev->filter == EVFILT_WRITE) {
 		revents |= EPOLLOUT;
 	}
@@ -382,6 +553,15 @@ registered_fds_node_feed_event(RegisteredFDsNode *fd2_node,
 	}
 #endif
 
+	if (kev->filter == EVFILT_READ) {
+		fd2_node->revents_nreadable = (int64_t)kev->data;
+	} else if (kev->filter == EVFILT_WRITE) {
+		fd2_node->revents_nwritable = (int64_t)kev->data;
+	}
+	if ((kev->flags & EV_EOF) && kev->fflags) {
+		fd2_node->revents_error = (int)kev->fflags;
+	}
+
 	if (fd2_node->node_type == NODE_TYPE_SOCKET) {
 		if (kev->filter == EVFILT_READ) {
 			if (kev->flags & EV_EOF) {
@@ -518,11 +698,15 @@ registered_fds_node_register_for_completion(int *kq,
 
 	if (fd2_node->has_evfilt_read && !fd2_node->got_evfilt_read) {
 		EV_SET(&kev[n++], fd2_node->fd, EVFILT_READ,
-		    EV_ADD | EV_ONESHOT | EV_RECEIPT, 0, 0, fd2_node);
+		    EV_ADD | EV_ONESHOT | EV_RECEIPT,
+		    lowat_fflags(fd2_node->rcvlowat), fd2_node->rcvlowat,
+		    fd2_node);
 	}
 	if (fd2_node->has_evfilt_write && !fd2_node->got_evfilt_write) {
 		EV_SET(&kev[n++], fd2_node->fd, EVFILT_WRITE,
-		    EV_ADD | EV_ONESHOT | EV_RECEIPT, 0, 0, fd2_node);
+		    EV_ADD | EV_ONESHOT | EV_RECEIPT,
+		    lowat_fflags(fd2_node->sndlowat), fd2_node->sndlowat,
+		    fd2_node);
 	}
 	if (fd2_node->has_evfilt_except && !fd2_node->got_evfilt_except) {
 #ifdef EVFILT_EXCEPT
@@ -579,50 +763,132 @@ fd_cmp(RegisteredFDsNode *e1, RegisteredFDsNode *e2)
 RB_PROTOTYPE_STATIC(registered_fds_set_, registered_fds_node_, entry, fd_cmp);
 RB_GENERATE_STATIC(registered_fds_set_, registered_fds_node_, entry, fd_cmp);
 
+static errno_t
+epollfd_ctx__create_shards(EpollFDCtx *epollfd)
+{
+	errno_t ec;
+
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nr_shards = nr_cpus < 2 ? 2
+	    : nr_cpus > EPOLLFD_CTX_MAX_SHARDS ? EPOLLFD_CTX_MAX_SHARDS
+					       : (size_t)nr_cpus;
+
+	epollfd->shard_kqs = malloc(nr_shards * sizeof(int));
+	if (!epollfd->shard_kqs) {
+		return errno;
+	}
+
+	for (; epollfd->nr_shards < nr_shards; ++epollfd->nr_shards) {
+		int shard_kq = kqueue();
+		if (shard_kq < 0) {
+			ec = errno;
+			goto fail;
+		}
+
+		/* Makes the epoll fd readable while the shard has events. */
+		struct kevent kevs[1];
+		EV_SET(&kevs[0], shard_kq, EVFILT_READ, EV_ADD, 0, 0, epollfd);
+		if (kevent(epollfd->kq, kevs, 1, NULL, 0, NULL) < 0) {
+			ec = errno;
+			(void)close(shard_kq);
+			goto fail;
+		}
+
+		epollfd->shard_kqs[epollfd->nr_shards] = shard_kq;
+	}
+
+	return 0;
+
+fail:
+	while (epollfd->nr_shards > 0) {
+		(void)close(epollfd->shard_kqs[--epollfd->nr_shards]);
+	}
+	free(epollfd->shard_kqs);
+	epollfd->shard_kqs = NULL;
+	return ec;
+}
+
+/* Poll set versions are unique across all epoll instances. */
+static atomic_uint_least64_t pollfds_stamp_counter;
+
+static void
+epollfd_ctx__bump_pollfds_stamp(EpollFDCtx *epollfd)
+{
+	epollfd->pollfds_stamp = atomic_fetch_add(&pollfds_stamp_counter, 1) +
+	    1;
+}
+
 errno_t
-epollfd_ctx_init(EpollFDCtx *epollfd, int kq)
+epollfd_ctx_init(EpollFDCtx *epollfd, int kq, int flags)
 {
 	errno_t ec;
 
+	assert((flags &
+		   ~(EPOLLFD_CTX_FLAG_POLLER_THREAD | EPOLLFD_CTX_FLAG_SHARDED |
+		       EPOLLFD_CTX_FLAG_SINGLE_THREADED)) == 0);
+
+	bool is_single_threaded =
+#ifdef EPOLL_SHIM_SINGLE_THREADED
+	    true;
+#else
+	    (flags & EPOLLFD_CTX_FLAG_SINGLE_THREADED) != 0;
+#endif
+
+	/* The poller thread would be a second user of the epoll. */
+	if ((flags & EPOLLFD_CTX_FLAG_POLLER_THREAD) && is_single_threaded) {
+		return EINVAL;
+	}
+
 	*epollfd = (EpollFDCtx){
 	    .kq = kq,
+	    .flags = flags,
 	    .registered_fds = RB_INITIALIZER(&registered_fds),
+	    .use_poller_thread = (flags & EPOLLFD_CTX_FLAG_POLLER_THREAD) != 0,
+	    .poller_pipe = {-1, -1},
 	    .self_pipe = {-1, -1},
 	};
 
-	TAILQ_INIT(&epollfd->poll_fds);
+	TAILQ_INIT(&epollfd->triggered_nodes);
+	SLIST_INIT(&epollfd->dead_nodes);
 
-	if ((ec = pthread_mutex_init(&epollfd->mutex, NULL)) != 0) {
-		return ec;
+	for (size_t i = 0; i < EPOLLFD_CTX_NR_FD_BUCKETS; ++i) {
+		atomic_init(&epollfd->nr_registrations_by_fd_bucket[i], 0);
 	}
+	atomic_init(&epollfd->polling_state, 0);
+	atomic_init(&epollfd->nr_stale_polling_threads, 0);
+	epollfd_ctx__bump_pollfds_stamp(epollfd);
 
-	if ((ec = pthread_mutex_init(&epollfd->nr_polling_threads_mutex,
-		 NULL)) != 0) {
-		pthread_mutex_destroy(&epollfd->mutex);
+	if ((flags & EPOLLFD_CTX_FLAG_SHARDED) &&
+	    (ec = epollfd_ctx__create_shards(epollfd)) != 0) {
 		return ec;
 	}
 
-	if ((ec = pthread_cond_init(&epollfd->nr_polling_threads_cond,
-		 NULL)) != 0) {
-		pthread_mutex_destroy(&epollfd->nr_polling_threads_mutex);
-		pthread_mutex_destroy(&epollfd->mutex);
-		return ec;
+	if ((ec = shim_mutex_init(&epollfd->mutex, /**/
+		 (flags & EPOLLFD_CTX_FLAG_SINGLE_THREADED) != 0)) != 0) {
+		goto fail;
 	}
 
 	return 0;
+
+fail:
+	for (size_t i = 0; i < epollfd->nr_shards; ++i) {
+		(void)close(epollfd->shard_kqs[i]);
+	}
+	free(epollfd->shard_kqs);
+	return ec;
 }
 
+static void epollfd_ctx__stop_poller_thread(EpollFDCtx *epollfd);
+
 errno_t
 epollfd_ctx_terminate(EpollFDCtx *epollfd)
 {
 	errno_t ec = 0;
 	errno_t ec_local;
 
-	ec_local = pthread_cond_destroy(&epollfd->nr_polling_threads_cond);
-	ec = ec ? ec : ec_local;
-	ec_local = pthread_mutex_destroy(&epollfd->nr_polling_threads_mutex);
-	ec = ec ? ec : ec_local;
-	ec_local = pthread_mutex_destroy(&epollfd->mutex);
+	epollfd_ctx__stop_poller_thread(epollfd);
+
+	ec_local = shim_mutex_destroy(&epollfd->mutex);
 	ec = ec ? ec : ec_local;
 
 	RegisteredFDsNode *np;
@@ -631,11 +897,30 @@ epollfd_ctx_terminate(EpollFDCtx *epollfd)
 	    np_temp)
 	{
 		RB_REMOVE(registered_fds_set_, &epollfd->registered_fds, np);
+		if (np->node_type == NODE_TYPE_EVENTFD &&
+		    np->node_data.eventfd.is_attached) {
+			/* Stop the eventfd from triggering our kqueue. */
+			eventfd_watch_detach(np->node_data.eventfd.watch,
+			    epollfd->kq);
+		}
+		registered_fds_node_destroy(np);
+	}
+
+	assert(epollfd->nr_harvesting == 0);
+	while ((np = SLIST_FIRST(&epollfd->dead_nodes)) != NULL) {
+		SLIST_REMOVE_HEAD(&epollfd->dead_nodes, dead_entry);
 		registered_fds_node_destroy(np);
 	}
 
-	free(epollfd->kevs);
+	for (size_t i = 0; i < epollfd->nr_shards; ++i) {
+		(void)close(epollfd->shard_kqs[i]);
+	}
+	free(epollfd->shard_kqs);
+
 	free(epollfd->pfds);
+	free(epollfd->pfd_nodes);
+	free(epollfd->probe_pfds);
+	free(epollfd->probe_nodes);
 	if (epollfd->self_pipe[0] >= 0 && epollfd->self_pipe[1] >= 0) {
 		(void)close(epollfd->self_pipe[0]);
 		(void)close(epollfd->self_pipe[1]);
@@ -644,36 +929,123 @@ epollfd_ctx_terminate(EpollFDCtx *epollfd)
 	return ec;
 }
 
+/*
+ * Kevents are harvested into a buffer of the calling thread. It is capped at
+ * KEVS_MAX_LENGTH entries, larger requests are served partially. Every
+ * KEVS_TRIM_INTERVAL uses, the buffer shrinks to the largest recent request
+ * if that is much smaller, so memory is returned after a spike.
+ */
+#define KEVS_MIN_LENGTH 32
+#define KEVS_MAX_LENGTH 4096
+#define KEVS_TRIM_INTERVAL 64
+
+typedef struct {
+	struct kevent *kevs;
+	size_t length;
+	size_t max_requested;
+	unsigned nr_uses;
+} KeventBuffer;
+
+static pthread_once_t kevent_buffer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t kevent_buffer_key;
+static errno_t kevent_buffer_key_ec;
+
+static void
+kevent_buffer_destroy(void *arg)
+{
+	KeventBuffer *buffer = arg;
+
+	free(buffer->kevs);
+	free(buffer);
+}
+
+static void
+kevent_buffer_create_key(void)
+{
+	kevent_buffer_key_ec = pthread_key_create(&kevent_buffer_key,
+	    kevent_buffer_destroy);
+}
+
 static errno_t
-epollfd_ctx_make_kevs_space(EpollFDCtx *epollfd, size_t cnt)
+kevent_buffer_acquire(size_t cnt, struct kevent **kevs, size_t *kevs_length)
 {
-	assert(cnt > 0);
+	errno_t ec;
 
-	if (cnt <= epollfd->kevs_length) {
-		return 0;
+	(void)pthread_once(&kevent_buffer_once, kevent_buffer_create_key);
+	if (kevent_buffer_key_ec != 0) {
+		return kevent_buffer_key_ec;
 	}
 
-	size_t size;
-	if (__builtin_mul_overflow(cnt, sizeof(struct kevent), &size)) {
-		return ENOMEM;
+	KeventBuffer *buffer = pthread_getspecific(kevent_buffer_key);
+	if (!buffer) {
+		buffer = calloc(1, sizeof(KeventBuffer));
+		if (!buffer) {
+			return errno;
+		}
+
+		if ((ec = pthread_setspecific(kevent_buffer_key, buffer)) !=
+		    0) {
+			free(buffer);
+			return ec;
+		}
 	}
 
-	struct kevent *new_kevs = realloc(epollfd->kevs, size);
-	if (!new_kevs) {
-		return errno;
+	assert(cnt > 0);
+	if (cnt > KEVS_MAX_LENGTH) {
+		cnt = KEVS_MAX_LENGTH;
 	}
+	if (cnt > buffer->max_requested) {
+		buffer->max_requested = cnt;
+	}
+
+	if (cnt > buffer->length) {
+		size_t length = cnt < KEVS_MIN_LENGTH ? KEVS_MIN_LENGTH : cnt;
 
-	epollfd->kevs = new_kevs;
-	epollfd->kevs_length = cnt;
+		struct kevent *new_kevs = realloc(buffer->kevs,
+		    length * sizeof(struct kevent));
+		if (!new_kevs) {
+			return errno;
+		}
+
+		buffer->kevs = new_kevs;
+		buffer->length = length;
+	}
 
+	*kevs = buffer->kevs;
+	*kevs_length = cnt;
 	return 0;
 }
 
-static errno_t
-epollfd_ctx_make_pfds_space(EpollFDCtx *epollfd)
+static void
+kevent_buffer_release(void)
 {
-	size_t cnt = 1 + epollfd->poll_fds_size;
+	KeventBuffer *buffer = pthread_getspecific(kevent_buffer_key);
+	assert(buffer != NULL);
+
+	if (++buffer->nr_uses < KEVS_TRIM_INTERVAL) {
+		return;
+	}
+
+	size_t length = buffer->max_requested < KEVS_MIN_LENGTH
+	    ? KEVS_MIN_LENGTH
+	    : buffer->max_requested;
+
+	if (buffer->length >= 4 * length) {
+		struct kevent *new_kevs = realloc(buffer->kevs,
+		    length * sizeof(struct kevent));
+		if (new_kevs) {
+			buffer->kevs = new_kevs;
+			buffer->length = length;
+		}
+	}
 
+	buffer->max_requested = 0;
+	buffer->nr_uses = 0;
+}
+
+static errno_t
+epollfd_ctx_make_pfds_space(EpollFDCtx *epollfd, size_t cnt)
+{
 	if (cnt <= epollfd->pfds_length) {
 		return 0;
 	}
@@ -687,108 +1059,570 @@ epollfd_ctx_make_pfds_space(EpollFDCtx *epollfd)
 	if (!new_pfds) {
 		return errno;
 	}
-
 	epollfd->pfds = new_pfds;
+
+	if (__builtin_mul_overflow(cnt, sizeof(RegisteredFDsNode *), &size)) {
+		return ENOMEM;
+	}
+
+	RegisteredFDsNode **new_pfd_nodes = realloc(epollfd->pfd_nodes, size);
+	if (!new_pfd_nodes) {
+		return errno;
+	}
+	epollfd->pfd_nodes = new_pfd_nodes;
+
 	epollfd->pfds_length = cnt;
 
 	return 0;
 }
 
-static errno_t
-epollfd_ctx__add_self_trigger(EpollFDCtx *epollfd)
+static void
+epollfd_ctx__swap_pollfds(EpollFDCtx *epollfd, size_t i, size_t j)
 {
-	struct kevent kevs[1];
-
-#ifdef EVFILT_USER
-	EV_SET(&kevs[0], 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
-#else
-	if (epollfd->self_pipe[0] < 0 && epollfd->self_pipe[1] < 0) {
-		if (pipe2(epollfd->self_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
-			errno_t ec = errno;
-			epollfd->self_pipe[0] = epollfd->self_pipe[1] = -1;
-			return ec;
-		}
-
-		assert(epollfd->self_pipe[0] >= 0);
-		assert(epollfd->self_pipe[1] >= 0);
+	if (i == j) {
+		return;
 	}
 
-	EV_SET(&kevs[0], epollfd->self_pipe[0], EVFILT_READ, /**/
-	    EV_ADD | EV_CLEAR, 0, 0, 0);
-#endif
+	struct pollfd pfd = epollfd->pfds[i];
+	epollfd->pfds[i] = epollfd->pfds[j];
+	epollfd->pfds[j] = pfd;
 
-	if (kevent(epollfd->kq, kevs, 1, NULL, 0, NULL) < 0) {
-		return errno;
-	}
+	RegisteredFDsNode *fd2_node = epollfd->pfd_nodes[i];
+	epollfd->pfd_nodes[i] = epollfd->pfd_nodes[j];
+	epollfd->pfd_nodes[j] = fd2_node;
 
-	return 0;
+	epollfd->pfd_nodes[i]->pollfd_index = i;
+	epollfd->pfd_nodes[j]->pollfd_index = j;
 }
 
+/*
+ * Brings the pollfd of a poll-only node up to date. With a poller thread,
+ * waiters only check edge triggered fds with reported readiness. Checked
+ * entries are kept in front, so a node may move to another index.
+ */
 static void
-epollfd_ctx__trigger_self(EpollFDCtx *epollfd)
+epollfd_ctx__update_pollfd(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 {
-#ifdef EVFILT_USER
-	struct kevent kevs[1];
-	EV_SET(&kevs[0], 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
-	(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
-#else
-	assert(epollfd->self_pipe[0] >= 0);
-	assert(epollfd->self_pipe[1] >= 0);
+	assert(fd2_node->pollfd_index != 0);
 
-	char c = 0;
-	(void)write(epollfd->self_pipe[1], &c, 1);
-#endif
+	bool was_checked = epollfd->pfds[fd2_node->pollfd_index].fd >= 0;
+	bool is_checked = !epollfd->use_poller_thread ||
+	    (fd2_node->is_edge_triggered && fd2_node->poll_revents);
+
+	if (was_checked != is_checked) {
+		if (is_checked) {
+			epollfd_ctx__swap_pollfds(epollfd,
+			    fd2_node->pollfd_index,
+			    ++epollfd->nr_checked_poll_fds);
+		} else {
+			epollfd_ctx__swap_pollfds(epollfd,
+			    fd2_node->pollfd_index,
+			    epollfd->nr_checked_poll_fds--);
+		}
+	}
+
+	struct pollfd *pfd = &epollfd->pfds[fd2_node->pollfd_index];
+	pfd->fd = is_checked ? fd2_node->fd : ~fd2_node->fd;
+	pfd->events = (short)fd2_node->events;
+
+	epollfd_ctx__bump_pollfds_stamp(epollfd);
 }
 
+static errno_t
+epollfd_ctx__add_pollfd(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
+{
+	errno_t ec;
+
+	assert(fd2_node->pollfd_index == 0);
+
+	if ((ec = epollfd_ctx_make_pfds_space(epollfd,
+		 2 + epollfd->poll_fds_size)) != 0) {
+		return ec;
+	}
+
+	size_t i = ++epollfd->poll_fds_size;
+	epollfd->pfds[i] = (struct pollfd){.fd = -1};
+	epollfd->pfd_nodes[i] = fd2_node;
+	fd2_node->pollfd_index = i;
+
+	epollfd_ctx__update_pollfd(epollfd, fd2_node);
+
+	return 0;
+}
+
+/* Moves the last entry (of its part) into the hole. */
 static void
-epollfd_ctx__trigger_repoll(EpollFDCtx *epollfd)
+epollfd_ctx__remove_pollfd(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 {
-	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-	unsigned long nr_polling_threads = epollfd->nr_polling_threads;
-	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
+	assert(fd2_node->pollfd_index != 0 &&
+	    fd2_node->pollfd_index <= epollfd->poll_fds_size);
+	assert(epollfd->pfd_nodes[fd2_node->pollfd_index] == fd2_node);
 
-	if (nr_polling_threads == 0) {
-		return;
+	if (epollfd->pfds[fd2_node->pollfd_index].fd >= 0) {
+		assert(epollfd->nr_checked_poll_fds != 0);
+		epollfd_ctx__swap_pollfds(epollfd, fd2_node->pollfd_index,
+		    epollfd->nr_checked_poll_fds--);
 	}
 
-	epollfd_ctx__trigger_self(epollfd);
+	size_t i = fd2_node->pollfd_index;
+	size_t last = epollfd->poll_fds_size;
 
-	(void)pthread_mutex_lock(&epollfd->nr_polling_threads_mutex);
-	while (epollfd->nr_polling_threads != 0) {
-		pthread_cond_wait(&epollfd->nr_polling_threads_cond,
-		    &epollfd->nr_polling_threads_mutex);
+	if (i != last) {
+		epollfd->pfds[i] = epollfd->pfds[last];
+		epollfd->pfd_nodes[i] = epollfd->pfd_nodes[last];
+		epollfd->pfd_nodes[i]->pollfd_index = i;
 	}
-	(void)pthread_mutex_unlock(&epollfd->nr_polling_threads_mutex);
 
-#ifndef EVFILT_USER
-	char c[32];
-	while (read(epollfd->self_pipe[0], c, sizeof(c)) >= 0) {
+	--epollfd->poll_fds_size;
+	fd2_node->pollfd_index = 0;
+
+	epollfd_ctx__bump_pollfds_stamp(epollfd);
+}
+
+/*
+ * Returns the index of the first pollfd in [i, nfds) with non-zero
+ * 'revents', or 'nfds'. Idle entries are skipped four at a time.
+ */
+static size_t
+pollfds_next_ready(struct pollfd const *pfds, size_t i, size_t nfds)
+{
+	for (; i + 4 <= nfds; i += 4) {
+		if ((pfds[i].revents | pfds[i + 1].revents |
+			pfds[i + 2].revents | pfds[i + 3].revents) != 0) {
+			break;
+		}
+	}
+
+	for (; i < nfds; ++i) {
+		if (pfds[i].revents) {
+			return i;
+		}
+	}
+
+	return nfds;
+}
+
+static errno_t
+epollfd_ctx_make_probe_space(EpollFDCtx *epollfd, size_t cnt)
+{
+	if (cnt <= epollfd->probe_length) {
+		return 0;
+	}
+
+	size_t size;
+	if (__builtin_mul_overflow(cnt, sizeof(struct pollfd), &size)) {
+		return ENOMEM;
+	}
+
+	struct pollfd *new_pfds = realloc(epollfd->probe_pfds, size);
+	if (!new_pfds) {
+		return errno;
+	}
+	epollfd->probe_pfds = new_pfds;
+
+	if (__builtin_mul_overflow(cnt, sizeof(RegisteredFDsNode *), &size)) {
+		return ENOMEM;
+	}
+
+	RegisteredFDsNode **new_nodes = realloc(epollfd->probe_nodes, size);
+	if (!new_nodes) {
+		return errno;
+	}
+	epollfd->probe_nodes = new_nodes;
+
+	epollfd->probe_length = cnt;
+
+	return 0;
+}
+
+/*
+ * Resolves the poll probes that feeding 'kevs' needs with a single poll
+ * call. Returns the number of probed nodes. If batching is not possible,
+ * the nodes are probed one by one while feeding.
+ */
+static size_t
+epollfd_ctx__probe_nodes(EpollFDCtx *epollfd, struct kevent const *kevs,
+    int n)
+{
+	size_t nr_probes = 0;
+
+	for (int i = 0; i < n; ++i) {
+		RegisteredFDsNode *fd2_node =
+		    (RegisteredFDsNode *)kevs[i].udata;
+		short events;
+
+		if (fd2_node && !fd2_node->has_probe_revents &&
+		    registered_fds_node_needs_probe(fd2_node, &kevs[i],
+			&events)) {
+			if (epollfd_ctx_make_probe_space(epollfd,
+				(size_t)n) != 0) {
+				break;
+			}
+
+			epollfd->probe_pfds[nr_probes] = (struct pollfd){
+			    .fd = fd2_node->fd,
+			    .events = events,
+			};
+			epollfd->probe_nodes[nr_probes++] = fd2_node;
+			fd2_node->has_probe_revents = true;
+		}
 	}
+
+	bool is_batched = nr_probes > 1 &&
+	    poll(epollfd->probe_pfds, (nfds_t)nr_probes, 0) >= 0;
+
+	for (size_t i = 0; i < nr_probes; ++i) {
+		RegisteredFDsNode *fd2_node = epollfd->probe_nodes[i];
+
+		fd2_node->has_probe_revents = is_batched;
+		fd2_node->probe_revents = epollfd->probe_pfds[i].revents;
+	}
+
+	return is_batched ? nr_probes : 0;
+}
+
+static errno_t
+epollfd_ctx__add_self_trigger(EpollFDCtx *epollfd)
+{
+	struct kevent kevs[1];
+
+#ifdef EVFILT_USER
+	EV_SET(&kevs[0], 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+#else
+	if (epollfd->self_pipe[0] < 0 && epollfd->self_pipe[1] < 0) {
+		if (pipe2(epollfd->self_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			errno_t ec = errno;
+			epollfd->self_pipe[0] = epollfd->self_pipe[1] = -1;
+			return ec;
+		}
+
+		assert(epollfd->self_pipe[0] >= 0);
+		assert(epollfd->self_pipe[1] >= 0);
+	}
+
+	EV_SET(&kevs[0], epollfd->self_pipe[0], EVFILT_READ, /**/
+	    EV_ADD | EV_CLEAR, 0, 0, 0);
+#endif
+
+	if (kevent(epollfd->kq, kevs, 1, NULL, 0, NULL) < 0) {
+		return errno;
+	}
+
+	return 0;
+}
+
+static void
+epollfd_ctx__trigger_self(EpollFDCtx *epollfd)
+{
+#ifdef EVFILT_USER
+	struct kevent kevs[1];
+	EV_SET(&kevs[0], 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+	(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
+#else
+	assert(epollfd->self_pipe[0] >= 0);
+	assert(epollfd->self_pipe[1] >= 0);
+
+	char c = 0;
+	(void)write(epollfd->self_pipe[1], &c, 1);
 #endif
 }
 
+/*
+ * Makes the poller thread pick up changes to the poll set. Must be called
+ * with the epoll mutex held.
+ */
 static void
+epollfd_ctx__wake_poller_thread(EpollFDCtx *epollfd)
+{
+	++epollfd->poll_fds_generation;
+
+	if (epollfd->has_poller_thread) {
+		char c = 0;
+		(void)write(epollfd->poller_pipe[1], &c, 1);
+	}
+}
+
+static errno_t
+epollfd_ctx_remove_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node);
+
+/*
+ * Fills the pollfd used to block on a poll-only fd. Edge triggered nodes do
+ * not wait for readiness that has already been reported. POLLERR/POLLHUP
+ * cannot be masked, so such fds are left out completely.
+ */
+static void
+registered_fds_node_fill_blocking_pollfd(RegisteredFDsNode *fd2_node,
+    struct pollfd *pfd)
+{
+	uint32_t events = fd2_node->events;
+	int fd = fd2_node->fd;
+
+	if (fd2_node->is_edge_triggered) {
+		events &= ~fd2_node->poll_revents;
+
+		if (fd2_node->poll_revents & (POLLERR | POLLHUP)) {
+			fd = -1;
+		}
+	}
+
+	*pfd = (struct pollfd){
+	    .fd = fd,
+	    .events = (short)events,
+	};
+}
+
+static void *
+epollfd_ctx__poller_thread_fun(void *arg)
+{
+	EpollFDCtx *epollfd = arg;
+
+	/* The poll set is private, but 'nodes' are only used under lock. */
+	struct pollfd *pfds = NULL;
+	RegisteredFDsNode **nodes = NULL;
+	size_t pfds_length = 0;
+
+	shim_mutex_lock(&epollfd->mutex);
+
+	while (!epollfd->poller_thread_quit) {
+		unsigned long generation = epollfd->poll_fds_generation;
+
+		size_t cnt = 1 + epollfd->poll_fds_size;
+		if (cnt > pfds_length) {
+			size_t size;
+			struct pollfd *new_pfds;
+			RegisteredFDsNode **new_nodes;
+
+			if (!__builtin_mul_overflow(cnt, sizeof(struct pollfd),
+				&size) &&
+			    (new_pfds = realloc(pfds, size))) {
+				pfds = new_pfds;
+
+				if (!__builtin_mul_overflow(cnt,
+					sizeof(RegisteredFDsNode *), &size) &&
+				    (new_nodes = realloc(nodes, size))) {
+					nodes = new_nodes;
+					pfds_length = cnt;
+				}
+			}
+		}
+
+		struct pollfd wake_pfd;
+		struct pollfd *poll_pfds = pfds;
+		nfds_t nfds = 1;
+		int timeout = -1;
+
+		if (cnt > pfds_length) {
+			/* Out of memory, retry later. */
+			poll_pfds = &wake_pfd;
+			timeout = 100;
+		}
+
+		poll_pfds[0] = (struct pollfd){
+		    .fd = epollfd->poller_pipe[0],
+		    .events = POLLIN,
+		};
+
+		if (poll_pfds == pfds) {
+			for (size_t i = 1; i <= epollfd->poll_fds_size; ++i) {
+				RegisteredFDsNode *poll_node =
+				    epollfd->pfd_nodes[i];
+
+				if (poll_node->is_poller_triggered) {
+					continue;
+				}
+
+				nodes[nfds] = poll_node;
+				registered_fds_node_fill_blocking_pollfd(
+				    poll_node, &pfds[nfds++]);
+			}
+		}
+
+		shim_mutex_unlock(&epollfd->mutex);
+
+		int n = poll(poll_pfds, nfds, timeout);
+		if (n > 0 && poll_pfds[0].revents) {
+			char c[32];
+			while (read(epollfd->poller_pipe[0], c, sizeof(c)) >=
+			    0) {
+			}
+		}
+
+		shim_mutex_lock(&epollfd->mutex);
+
+		/* Results for a stale poll set are discarded. */
+		if (n <= 0 || poll_pfds != pfds ||
+		    generation != epollfd->poll_fds_generation) {
+			continue;
+		}
+
+		/* Node removal bumps the generation, but leaves the other
+		 * nodes in place. */
+		for (size_t i = 1;; ++i) {
+			i = pollfds_next_ready(pfds, i, nfds);
+			if (i == nfds) {
+				break;
+			}
+
+			RegisteredFDsNode *poll_node = nodes[i];
+
+			if (pfds[i].revents & POLLNVAL) {
+				epollfd_ctx_remove_node(epollfd, poll_node);
+				++epollfd->nr_evictions;
+			} else {
+				/* Stays out of the poll set until harvested. */
+				poll_node->is_poller_triggered = true;
+				registered_fds_node_trigger_self(poll_node,
+				    epollfd);
+			}
+		}
+	}
+
+	shim_mutex_unlock(&epollfd->mutex);
+
+	free(pfds);
+	free(nodes);
+	return NULL;
+}
+
+static errno_t
+epollfd_ctx__start_poller_thread(EpollFDCtx *epollfd)
+{
+	errno_t ec;
+
+	if (epollfd->has_poller_thread) {
+		return 0;
+	}
+
+	if (pipe2(epollfd->poller_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		ec = errno;
+		epollfd->poller_pipe[0] = epollfd->poller_pipe[1] = -1;
+		return ec;
+	}
+
+	/* Signals must not be delivered to the poller thread. */
+	sigset_t set, oldset;
+	sigfillset(&set);
+	(void)pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	ec = pthread_create(&epollfd->poller_thread, NULL,
+	    &epollfd_ctx__poller_thread_fun, epollfd);
+	(void)pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (ec != 0) {
+		(void)close(epollfd->poller_pipe[0]);
+		(void)close(epollfd->poller_pipe[1]);
+		epollfd->poller_pipe[0] = epollfd->poller_pipe[1] = -1;
+		return ec;
+	}
+
+	epollfd->has_poller_thread = true;
+	return 0;
+}
+
+static void
+epollfd_ctx__stop_poller_thread(EpollFDCtx *epollfd)
+{
+	if (!epollfd->has_poller_thread) {
+		return;
+	}
+
+	shim_mutex_lock(&epollfd->mutex);
+	epollfd->poller_thread_quit = true;
+	epollfd_ctx__wake_poller_thread(epollfd);
+	shim_mutex_unlock(&epollfd->mutex);
+
+	(void)pthread_join(epollfd->poller_thread, NULL);
+	epollfd->has_poller_thread = false;
+
+	(void)close(epollfd->poller_pipe[0]);
+	(void)close(epollfd->poller_pipe[1]);
+	epollfd->poller_pipe[0] = epollfd->poller_pipe[1] = -1;
+}
+
+static void
+epollfd_ctx__trigger_repoll(EpollFDCtx *epollfd)
+{
+	if (epollfd->use_poller_thread) {
+		/* Waiters do not poll the poll-only fds themselves. */
+		epollfd_ctx__wake_poller_thread(epollfd);
+		return;
+	}
+
+	/*
+	 * Publish a new version of the poll set. Threads blocked on the old
+	 * one rebuild theirs after waking up, there is no need to wait for
+	 * them. They are counted as stale before the version changes, so
+	 * that the count never drops below zero.
+	 */
+	uint_least64_t state = atomic_load(&epollfd->polling_state);
+	for (;;) {
+		unsigned long nr_polling_threads = state & 0xffffffff;
+		if (nr_polling_threads == 0) {
+			return;
+		}
+
+		atomic_fetch_add(&epollfd->nr_stale_polling_threads,
+		    nr_polling_threads);
+
+		uint_least64_t new_state = ((state >> 32) + 1) << 32;
+		if (atomic_compare_exchange_weak(&epollfd->polling_state,
+			&state, new_state)) {
+			break;
+		}
+
+		atomic_fetch_sub(&epollfd->nr_stale_polling_threads,
+		    nr_polling_threads);
+	}
+
+	epollfd_ctx__trigger_self(epollfd);
+}
+
+/*
+ * Nodes that register knotes on the fd itself. kqueue validates the fd on
+ * every change, so a closed fd shows up as EBADF in the receipts.
+ */
+static bool
+registered_fds_node_has_fd_knotes(RegisteredFDsNode *fd2_node)
+{
+	return fd2_node->node_type != NODE_TYPE_POLL &&
+	    fd2_node->node_type != NODE_TYPE_EVENTFD;
+}
+
+/*
+ * Returns EBADF if the knote removal showed that the fd has been closed
+ * already, zero otherwise.
+ */
+static errno_t
 epollfd_ctx__remove_node_from_kq(EpollFDCtx *epollfd,
     RegisteredFDsNode *fd2_node)
 {
-	if (fd2_node->is_on_pollfd_list) {
-		TAILQ_REMOVE(&epollfd->poll_fds, fd2_node, pollfd_list_entry);
-		fd2_node->is_on_pollfd_list = false;
-		assert(epollfd->poll_fds_size != 0);
-		--epollfd->poll_fds_size;
+	errno_t ec = 0;
 
-		epollfd_ctx__trigger_repoll(epollfd);
-	}
+	if (fd2_node->node_type == NODE_TYPE_EVENTFD) {
+#ifdef EVFILT_USER
+		if (fd2_node->node_data.eventfd.is_attached) {
+			EventFDWatch *watch = fd2_node->node_data.eventfd.watch;
 
-	if (fd2_node->self_pipe[0] >= 0) {
-		struct kevent kevs[1];
-		EV_SET(&kevs[0], fd2_node->self_pipe[0], EVFILT_READ, /**/
-		    EV_DELETE, 0, 0, 0);
-		(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
+			struct kevent kevs[1];
+			EV_SET(&kevs[0], (uintptr_t)watch, EVFILT_USER, /**/
+			    EV_DELETE, 0, 0, 0);
+			(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
 
-		char c[32];
-		while (read(fd2_node->self_pipe[0], c, sizeof(c)) >= 0) {
+			eventfd_watch_detach(watch, epollfd->kq);
+			fd2_node->node_data.eventfd.is_attached = false;
 		}
+#endif
+		return 0;
+	}
+
+	if (fd2_node->pollfd_index != 0) {
+		epollfd_ctx__remove_pollfd(epollfd, fd2_node);
+		epollfd_ctx__trigger_repoll(epollfd);
+	}
+
+	if (fd2_node->is_self_triggered) {
+		TAILQ_REMOVE(&epollfd->triggered_nodes, fd2_node,
+		    trigger_entry);
+		fd2_node->is_self_triggered = false;
 	}
 
 	if (fd2_node->node_type == NODE_TYPE_POLL) {
@@ -800,22 +1634,214 @@ epollfd_ctx__remove_node_from_kq(EpollFDCtx *epollfd,
 #endif
 	} else {
 		struct kevent kevs[3];
+		int n = 0;
 		int fd2 = fd2_node->fd;
+		int kq = registered_fds_node_kq(fd2_node, epollfd);
 
-		EV_SET(&kevs[0], fd2, EVFILT_READ, /**/
+		EV_SET(&kevs[n++], fd2, EVFILT_READ, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
-		EV_SET(&kevs[1], fd2, EVFILT_WRITE, /**/
+		EV_SET(&kevs[n++], fd2, EVFILT_WRITE, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
 #ifdef EVFILT_USER
-		EV_SET(&kevs[2], (uintptr_t)fd2_node, EVFILT_USER, /**/
+		EV_SET(&kevs[n++], (uintptr_t)fd2_node, EVFILT_USER, /**/
 		    EV_DELETE | EV_RECEIPT, 0, 0, 0);
+		if (kq != epollfd->kq) {
+			/* The self trigger lives on the epoll's kqueue. */
+			--n;
+			(void)kevent(epollfd->kq, &kevs[n], 1, &kevs[n], 1,
+			    NULL);
+		}
 #endif
-		(void)kevent(epollfd->kq, kevs, 3, kevs, 3, NULL);
+		/* Only EVFILT_READ is checked, see the NetBSD quirk in
+		 * 'epollfd_ctx__register_events'. */
+		int ret = kevent(kq, kevs, n, kevs, n, NULL);
+		if (ret > 0 && kevs[0].filter == EVFILT_READ &&
+		    kevs[0].data == EBADF) {
+			ec = EBADF;
+		}
 
 		fd2_node->has_evfilt_read = false;
 		fd2_node->has_evfilt_write = false;
 		fd2_node->has_evfilt_except = false;
 	}
+
+	fd2_node->is_disarmed = false;
+	return ec;
+}
+
+static void
+epollfd_ctx__disarm_oneshot_node(EpollFDCtx *epollfd,
+    RegisteredFDsNode *fd2_node)
+{
+	assert(fd2_node->is_oneshot);
+
+	if (!registered_fds_node_dispatch_flag(fd2_node)) {
+		epollfd_ctx__remove_node_from_kq(epollfd, fd2_node);
+		return;
+	}
+
+	struct kevent kevs[3];
+	int n = 0;
+	int fd2 = fd2_node->fd;
+
+	if (fd2_node->has_evfilt_read) {
+		EV_SET(&kevs[n++], fd2, EVFILT_READ, /**/
+		    EV_DISABLE | EV_RECEIPT, 0, 0, 0);
+	}
+	if (fd2_node->has_evfilt_write) {
+		EV_SET(&kevs[n++], fd2, EVFILT_WRITE, /**/
+		    EV_DISABLE | EV_RECEIPT, 0, 0, 0);
+	}
+#ifdef EVFILT_EXCEPT
+	if (fd2_node->has_evfilt_except) {
+		EV_SET(&kevs[n++], fd2, EVFILT_EXCEPT, /**/
+		    EV_DISABLE | EV_RECEIPT, 0, 0, 0);
+	}
+#endif
+
+	/*
+	 * EV_DISPATCH has already disabled the knote that fired. With a
+	 * single knote, this is the only one there is.
+	 */
+	if (n > 1) {
+		(void)kevent(registered_fds_node_kq(fd2_node, epollfd), /**/
+		    kevs, n, kevs, n, NULL);
+	}
+
+	fd2_node->is_disarmed = true;
+}
+
+/*
+ * Re-enable the knotes of a disarmed oneshot node in place. EV_ADD makes
+ * the filters re-evaluate the current state. Returns non-zero if the
+ * registration must be redone from scratch.
+ */
+static errno_t
+epollfd_ctx__rearm_oneshot_node(EpollFDCtx *epollfd,
+    RegisteredFDsNode *fd2_node)
+{
+	assert(fd2_node->is_disarmed);
+
+	unsigned short dispatch_flag =
+	    registered_fds_node_dispatch_flag(fd2_node);
+	if (!dispatch_flag) {
+		return EINVAL;
+	}
+
+	registered_fds_node_sanitize_flags(fd2_node);
+
+	/*
+	 * kqueue does not change EV_CLEAR or EV_DISPATCH of existing knotes,
+	 * so all flags must match what the knotes were added with.
+	 */
+	NeededFilters needed_filters = get_needed_filters(fd2_node);
+	unsigned short read_flags = (unsigned short)( /**/
+	    (needed_filters.evfilt_read & EV_CLEAR) | dispatch_flag);
+	unsigned short write_flags = (unsigned short)( /**/
+	    (needed_filters.evfilt_write & EV_CLEAR) | dispatch_flag);
+	unsigned short except_flags = (unsigned short)( /**/
+	    (needed_filters.evfilt_except & EV_CLEAR) | dispatch_flag);
+
+	if ((needed_filters.evfilt_read != 0) != fd2_node->has_evfilt_read ||
+	    (needed_filters.evfilt_write != 0) != fd2_node->has_evfilt_write ||
+	    (needed_filters.evfilt_except != 0) !=
+		fd2_node->has_evfilt_except ||
+	    (fd2_node->has_evfilt_read &&
+		read_flags != fd2_node->evfilt_read_flags) ||
+	    (fd2_node->has_evfilt_write &&
+		write_flags != fd2_node->evfilt_write_flags) ||
+	    (fd2_node->has_evfilt_except &&
+		except_flags != fd2_node->evfilt_except_flags)) {
+		return EINVAL;
+	}
+
+	struct kevent kevs[3];
+	int n = 0;
+	int fd2 = fd2_node->fd;
+
+	if (needed_filters.evfilt_read) {
+		EV_SET(&kevs[n++], fd2, EVFILT_READ,
+		    EV_ADD | EV_ENABLE | read_flags | EV_RECEIPT,
+		    lowat_fflags(fd2_node->rcvlowat), fd2_node->rcvlowat,
+		    fd2_node);
+	}
+	if (needed_filters.evfilt_write) {
+		EV_SET(&kevs[n++], fd2, EVFILT_WRITE,
+		    EV_ADD | EV_ENABLE | write_flags | EV_RECEIPT,
+		    lowat_fflags(fd2_node->sndlowat), fd2_node->sndlowat,
+		    fd2_node);
+	}
+	if (needed_filters.evfilt_except) {
+#ifdef EVFILT_EXCEPT
+		EV_SET(&kevs[n++], fd2, EVFILT_EXCEPT,
+		    EV_ADD | EV_ENABLE | except_flags | EV_RECEIPT, NOTE_OOB,
+		    0, fd2_node);
+#else
+		assert(0);
+#endif
+	}
+
+	assert(n != 0);
+
+	int ret = kevent(registered_fds_node_kq(fd2_node, epollfd), /**/
+	    kevs, n, kevs, n, NULL);
+	if (ret < 0) {
+		return errno;
+	}
+
+	for (int i = 0; i < ret; ++i) {
+		if (kevs[i].data != 0) {
+			return (errno_t)kevs[i].data;
+		}
+	}
+
+	fd2_node->is_disarmed = false;
+	return 0;
+}
+
+/*
+ * Shimmed eventfds are not added as nested kqueue, but get an EVFILT_USER
+ * knote on the epoll's kqueue that is triggered by the eventfd directly.
+ */
+static errno_t
+epollfd_ctx__register_eventfd_node(EpollFDCtx *epollfd,
+    RegisteredFDsNode *fd2_node)
+{
+#ifdef EVFILT_USER
+	EventFDWatch *watch = fd2_node->node_data.eventfd.watch;
+
+	if (!fd2_node->node_data.eventfd.is_attached) {
+		struct kevent kevs[1];
+
+		EV_SET(&kevs[0], (uintptr_t)watch, EVFILT_USER, /**/
+		    EV_ADD | EV_CLEAR, 0, 0, fd2_node);
+		if (kevent(epollfd->kq, kevs, 1, NULL, 0, NULL) < 0) {
+			return errno;
+		}
+
+		/* The eventfd may already be attached to another epoll. */
+		if (!eventfd_watch_attach(watch, epollfd->kq)) {
+			EV_SET(&kevs[0], (uintptr_t)watch, EVFILT_USER, /**/
+			    EV_DELETE, 0, 0, 0);
+			(void)kevent(epollfd->kq, kevs, 1, NULL, 0, NULL);
+			return EEXIST;
+		}
+
+		fd2_node->node_data.eventfd.is_attached = true;
+	}
+
+	/* Pick up readiness that was established before attaching. */
+	if (atomic_load(&watch->is_readable)) {
+		registered_fds_node_trigger_eventfd(fd2_node, epollfd);
+	}
+
+	return 0;
+#else
+	(void)epollfd;
+	(void)fd2_node;
+	assert(0);
+	return EINVAL;
+#endif
 }
 
 static errno_t
@@ -823,12 +1849,12 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 {
 	errno_t ec = 0;
 
-	/* Only sockets support EPOLLRDHUP and EPOLLPRI. */
-	if (fd2_node->node_type != NODE_TYPE_SOCKET) {
-		fd2_node->events &= ~(uint32_t)EPOLLRDHUP;
-		fd2_node->events &= ~(uint32_t)EPOLLPRI;
+	if (fd2_node->node_type == NODE_TYPE_EVENTFD) {
+		return epollfd_ctx__register_eventfd_node(epollfd, fd2_node);
 	}
 
+	registered_fds_node_sanitize_flags(fd2_node);
+
 	int const fd2 = fd2_node->fd;
 	struct kevent kev[4] = {
 	    {.data = 0},
@@ -854,20 +1880,30 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 		assert(!fd2_node->has_evfilt_except);
 
 		NeededFilters needed_filters = get_needed_filters(fd2_node);
+		unsigned short dispatch_flag =
+		    registered_fds_node_dispatch_flag(fd2_node);
 
 		if (needed_filters.evfilt_read) {
 			fd2_node->has_evfilt_read = true;
+			fd2_node->evfilt_read_flags = (unsigned short)( /**/
+			    (needed_filters.evfilt_read & EV_CLEAR) |
+			    dispatch_flag);
 			evfilt_read_index = n;
 			EV_SET(&kev[n++], fd2, EVFILT_READ,
-			    EV_ADD | (needed_filters.evfilt_read & EV_CLEAR),
-			    0, 0, fd2_node);
+			    EV_ADD | fd2_node->evfilt_read_flags,
+			    lowat_fflags(fd2_node->rcvlowat),
+			    fd2_node->rcvlowat, fd2_node);
 		}
 		if (needed_filters.evfilt_write) {
 			fd2_node->has_evfilt_write = true;
+			fd2_node->evfilt_write_flags = (unsigned short)( /**/
+			    (needed_filters.evfilt_write & EV_CLEAR) |
+			    dispatch_flag);
 			evfilt_write_index = n;
 			EV_SET(&kev[n++], fd2, EVFILT_WRITE,
-			    EV_ADD | (needed_filters.evfilt_write & EV_CLEAR),
-			    0, 0, fd2_node);
+			    EV_ADD | fd2_node->evfilt_write_flags,
+			    lowat_fflags(fd2_node->sndlowat),
+			    fd2_node->sndlowat, fd2_node);
 		}
 
 		assert(n != 0);
@@ -875,9 +1911,12 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 		if (needed_filters.evfilt_except) {
 #ifdef EVFILT_EXCEPT
 			fd2_node->has_evfilt_except = true;
+			fd2_node->evfilt_except_flags = (unsigned short)( /**/
+			    (needed_filters.evfilt_except & EV_CLEAR) |
+			    dispatch_flag);
 			EV_SET(&kev[n++], fd2, EVFILT_EXCEPT,
-			    EV_ADD | (needed_filters.evfilt_except & EV_CLEAR),
-			    NOTE_OOB, 0, fd2_node);
+			    EV_ADD | fd2_node->evfilt_except_flags, NOTE_OOB,
+			    0, fd2_node);
 #else
 			assert(0);
 #endif
@@ -887,7 +1926,8 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 			kev[i].flags |= EV_RECEIPT;
 		}
 
-		int ret = kevent(epollfd->kq, kev, n, kev, n, NULL);
+		int ret = kevent(registered_fds_node_kq(fd2_node, epollfd), /**/
+		    kev, n, kev, n, NULL);
 		if (ret < 0) {
 			ec = errno;
 			goto out;
@@ -915,22 +1955,31 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 		fd2_node->has_evfilt_except = false;
 
 		fd2_node->node_type = NODE_TYPE_POLL;
+		fd2_node->is_poller_triggered = false;
+		fd2_node->poll_revents = 0;
+
+		if (epollfd->use_poller_thread &&
+		    (ec = epollfd_ctx__start_poller_thread(epollfd)) != 0) {
+			goto out;
+		}
 
 		if ((ec = registered_fds_node_add_self_trigger(fd2_node,
 			 epollfd)) != 0) {
 			goto out;
 		}
 
-		if (!fd2_node->is_on_pollfd_list) {
+		if (fd2_node->pollfd_index == 0) {
 			if ((ec = /**/
 				epollfd_ctx__add_self_trigger(epollfd)) != 0) {
 				goto out;
 			}
 
-			TAILQ_INSERT_TAIL(&epollfd->poll_fds, fd2_node,
-			    pollfd_list_entry);
-			fd2_node->is_on_pollfd_list = true;
-			++epollfd->poll_fds_size;
+			if ((ec = epollfd_ctx__add_pollfd(epollfd,
+				 fd2_node)) != 0) {
+				goto out;
+			}
+		} else {
+			epollfd_ctx__update_pollfd(epollfd, fd2_node);
 		}
 
 		/* This is outside the above if because poll ".events" might
@@ -942,13 +1991,10 @@ epollfd_ctx__register_events(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 
 	for (int i = 0; i < 4; ++i) {
 		if (kev[i].data != 0) {
-			if ((kev[i].data == EPIPE
-#ifdef __NetBSD__
-				|| kev[i].data == EBADF
-#endif
-				) &&
-			    i == evfilt_write_index &&
-			    fd2_node->node_type == NODE_TYPE_FIFO) {
+			if (i == evfilt_write_index &&
+			    fd2_node->node_type == NODE_TYPE_FIFO &&
+			    kernel_caps_is_fifo_no_reader_error(fd2_node->fd,
+				(int)kev[i].data)) {
 
 				fd2_node->eof_state =
 				    EOF_STATE_READ_EOF | EOF_STATE_WRITE_EOF;
@@ -976,16 +2022,52 @@ out:
 	return ec;
 }
 
+/* Registrations per fd bucket, summed over all epoll instances. */
+static atomic_uint nr_registrations_by_fd_bucket[EPOLLFD_CTX_NR_FD_BUCKETS];
+
+static atomic_uint *
+epollfd_ctx__fd_bucket(EpollFDCtx *epollfd, int fd2)
+{
+	return &epollfd->nr_registrations_by_fd_bucket[(unsigned int)fd2 %
+	    EPOLLFD_CTX_NR_FD_BUCKETS];
+}
+
 static void
+epollfd_ctx__count_registration(EpollFDCtx *epollfd, int fd2, bool is_added)
+{
+	unsigned int i = (unsigned int)fd2 % EPOLLFD_CTX_NR_FD_BUCKETS;
+
+	if (is_added) {
+		atomic_fetch_add_explicit(&nr_registrations_by_fd_bucket[i], 1,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(epollfd_ctx__fd_bucket(epollfd, fd2),
+		    1, memory_order_relaxed);
+	} else {
+		atomic_fetch_sub_explicit(&nr_registrations_by_fd_bucket[i], 1,
+		    memory_order_relaxed);
+		atomic_fetch_sub_explicit(epollfd_ctx__fd_bucket(epollfd, fd2),
+		    1, memory_order_relaxed);
+	}
+}
+
+static errno_t
 epollfd_ctx_remove_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node)
 {
-	epollfd_ctx__remove_node_from_kq(epollfd, fd2_node);
+	errno_t ec = epollfd_ctx__remove_node_from_kq(epollfd, fd2_node);
 
 	RB_REMOVE(registered_fds_set_, &epollfd->registered_fds, fd2_node);
 	assert(epollfd->registered_fds_size > 0);
 	--epollfd->registered_fds_size;
+	epollfd_ctx__count_registration(epollfd, fd2_node->fd, false);
 
-	registered_fds_node_destroy(fd2_node);
+	if (epollfd->nr_harvesting != 0) {
+		fd2_node->is_dead = true;
+		SLIST_INSERT_HEAD(&epollfd->dead_nodes, fd2_node, dead_entry);
+	} else {
+		registered_fds_node_destroy(fd2_node);
+	}
+
+	return ec;
 }
 
 #if defined(__FreeBSD__)
@@ -1019,14 +2101,24 @@ modify_fifo_rights_from_capabilities(RegisteredFDsNode *fd2_node)
 
 static errno_t
 epollfd_ctx_add_node(EpollFDCtx *epollfd, int fd2, struct epoll_event *ev,
-    struct stat const *statbuf)
+    struct epoll_lowat const *lowat, struct stat const *statbuf,
+    EventFDCtx *fd2_eventfd, FDContextMapNode *fd2_consume_node)
 {
 	RegisteredFDsNode *fd2_node = registered_fds_node_create(fd2);
 	if (!fd2_node) {
 		return ENOMEM;
 	}
 
-	if (S_ISFIFO(statbuf->st_mode)) {
+	EventFDWatch *watch = NULL;
+	if (fd2_eventfd) {
+		errno_t ec;
+		watch = eventfd_ctx_watch_acquire(fd2_eventfd, &ec);
+	}
+
+	if (watch) {
+		fd2_node->node_type = NODE_TYPE_EVENTFD;
+		fd2_node->node_data.eventfd.watch = watch;
+	} else if (S_ISFIFO(statbuf->st_mode)) {
 		int tmp;
 
 		if (ioctl(fd2_node->fd, FIONREAD, &tmp) < 0 &&
@@ -1067,173 +2159,613 @@ epollfd_ctx_add_node(EpollFDCtx *epollfd, int fd2, struct epoll_event *ev,
 		fd2_node->node_type = NODE_TYPE_OTHER;
 	}
 
-	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev);
+	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev, lowat,
+	    fd2_consume_node);
+
+	void *colliding_node =
+	    RB_INSERT(registered_fds_set_, &epollfd->registered_fds, fd2_node);
+	(void)colliding_node;
+	assert(colliding_node == NULL);
+	++epollfd->registered_fds_size;
+	epollfd_ctx__count_registration(epollfd, fd2, true);
+
+	errno_t ec = epollfd_ctx__register_events(epollfd, fd2_node);
+	if (ec == EEXIST && fd2_node->node_type == NODE_TYPE_EVENTFD) {
+		/* Fall back to nesting the eventfd's kqueue. */
+		eventfd_watch_release(fd2_node->node_data.eventfd.watch);
+		fd2_node->node_type = NODE_TYPE_KQUEUE;
+		fd2_node->node_data.eventfd.watch = NULL;
+
+		ec = epollfd_ctx__register_events(epollfd, fd2_node);
+	}
+	if (ec != 0) {
+		epollfd_ctx_remove_node(epollfd, fd2_node);
+		return ec;
+	}
+
+	fd2_node->is_registered = true;
+
+	return 0;
+}
+
+static errno_t
+epollfd_ctx_modify_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node,
+    struct epoll_event *ev, struct epoll_lowat const *lowat,
+    FDContextMapNode *fd2_consume_node)
+{
+	int old_rcvlowat = fd2_node->rcvlowat;
+	int old_sndlowat = fd2_node->sndlowat;
+
+	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev, lowat,
+	    fd2_consume_node);
+
+	assert(fd2_node->is_registered);
+
+	if (fd2_node->is_disarmed && fd2_node->is_oneshot &&
+	    fd2_node->rcvlowat == old_rcvlowat &&
+	    fd2_node->sndlowat == old_sndlowat &&
+	    epollfd_ctx__rearm_oneshot_node(epollfd, fd2_node) == 0) {
+		return 0;
+	}
+
+	errno_t ec = epollfd_ctx__register_events(epollfd, fd2_node);
+	if (ec != 0) {
+		epollfd_ctx_remove_node(epollfd, fd2_node);
+		return ec;
+	}
+
+	return 0;
+}
+
+static errno_t
+epollfd_ctx_ctl_impl(EpollFDCtx *epollfd, int op, int fd2,
+    struct epoll_event *ev, struct epoll_lowat const *lowat,
+    EventFDCtx *fd2_eventfd, FDContextMapNode *fd2_consume_node)
+{
+	assert(op == EPOLL_CTL_DEL || ev != NULL);
+
+	if (epollfd->kq == fd2) {
+		return EINVAL;
+	}
+
+	if (op != EPOLL_CTL_DEL &&
+	    ((ev->events &
+		~(uint32_t)(EPOLLIN | EPOLLOUT | EPOLLRDHUP | /**/
+		    EPOLLPRI | /* unsupported by FreeBSD's kqueue! */
+		    EPOLLHUP | EPOLLERR | /**/
+		    EPOLLET | EPOLLONESHOT | EPOLLCONSUME)))) {
+		return EINVAL;
+	}
+
+	if (op != EPOLL_CTL_DEL && lowat) {
+		if (lowat->rcvlowat < 0 || lowat->sndlowat < 0) {
+			return EINVAL;
+		}
+#ifndef NOTE_LOWAT
+		if (lowat->rcvlowat != 0 || lowat->sndlowat != 0) {
+			return EINVAL;
+		}
+#endif
+	}
+
+	RegisteredFDsNode *fd2_node;
+	{
+		RegisteredFDsNode find;
+		find.fd = fd2;
+
+		fd2_node = RB_FIND(registered_fds_set_, /**/
+		    &epollfd->registered_fds, &find);
+	}
+
+	/*
+	 * Existing registrations remember their node type, so MOD and DEL
+	 * can skip the fstat. A closed fd is then detected through the
+	 * kevent receipts.
+	 */
+	struct stat statbuf;
+	if ((op == EPOLL_CTL_ADD || !fd2_node ||
+		!registered_fds_node_has_fd_knotes(fd2_node)) &&
+	    fstat(fd2, &statbuf) < 0) {
+		errno_t ec = errno;
+
+		/* If the fstat fails for any reason we must clear
+		 * internal state to avoid EEXIST errors in future
+		 * calls to epoll_ctl. */
+		if (fd2_node) {
+			epollfd_ctx_remove_node(epollfd, fd2_node);
+		}
+
+		return ec;
+	}
+
+	errno_t ec;
+
+	if (op == EPOLL_CTL_ADD) {
+		ec = fd2_node
+		    ? EEXIST
+		    : epollfd_ctx_add_node(epollfd, fd2, ev, lowat, &statbuf,
+			  fd2_eventfd, fd2_consume_node);
+	} else if (op == EPOLL_CTL_DEL) {
+		ec = !fd2_node ? ENOENT
+			       : epollfd_ctx_remove_node(epollfd, fd2_node);
+	} else if (op == EPOLL_CTL_MOD) {
+		ec = !fd2_node
+		    ? ENOENT
+		    : epollfd_ctx_modify_node(epollfd, fd2_node, ev, lowat,
+			  fd2_consume_node);
+	} else {
+		ec = EINVAL;
+	}
+
+	return ec;
+}
+
+/*
+ * The pollfds of blocking waiters are kept in a buffer of the calling
+ * thread, together with the version of the poll set they were filled from.
+ */
+typedef struct {
+	struct pollfd *pfds;
+	size_t length;
+	uint_least64_t stamp;
+} BlockingPollfdsBuffer;
+
+static pthread_once_t blocking_pollfds_once = PTHREAD_ONCE_INIT;
+static pthread_key_t blocking_pollfds_key;
+static errno_t blocking_pollfds_key_ec;
+
+static void
+blocking_pollfds_destroy(void *arg)
+{
+	BlockingPollfdsBuffer *buffer = arg;
+
+	free(buffer->pfds);
+	free(buffer);
+}
+
+static void
+blocking_pollfds_create_key(void)
+{
+	blocking_pollfds_key_ec = pthread_key_create(&blocking_pollfds_key,
+	    blocking_pollfds_destroy);
+}
+
+errno_t
+epollfd_ctx_blocking_pollfds(EpollFDCtx *epollfd, struct pollfd **pfds,
+    size_t *nfds)
+{
+	errno_t ec;
+
+	(void)pthread_once(&blocking_pollfds_once,
+	    blocking_pollfds_create_key);
+	if (blocking_pollfds_key_ec != 0) {
+		return blocking_pollfds_key_ec;
+	}
+
+	BlockingPollfdsBuffer *buffer = /**/
+	    pthread_getspecific(blocking_pollfds_key);
+	if (!buffer) {
+		buffer = calloc(1, sizeof(BlockingPollfdsBuffer));
+		if (!buffer) {
+			return errno;
+		}
+
+		if ((ec = pthread_setspecific(blocking_pollfds_key,
+			 buffer)) != 0) {
+			free(buffer);
+			return ec;
+		}
+	}
+
+	size_t cnt = epollfd->use_poller_thread ? 1
+						: 1 + epollfd->poll_fds_size;
+
+	if (buffer->stamp != epollfd->pollfds_stamp) {
+		if (cnt > buffer->length) {
+			size_t size;
+			if (__builtin_mul_overflow(cnt, sizeof(struct pollfd),
+				&size)) {
+				return ENOMEM;
+			}
+
+			struct pollfd *new_pfds = realloc(buffer->pfds, size);
+			if (!new_pfds) {
+				return errno;
+			}
+
+			buffer->pfds = new_pfds;
+			buffer->length = cnt;
+		}
+
+		buffer->pfds[0] = (struct pollfd){
+		    .fd = epollfd->kq,
+		    .events = POLLIN,
+		};
+
+		for (size_t i = 1; i < cnt; ++i) {
+			registered_fds_node_fill_blocking_pollfd(
+			    epollfd->pfd_nodes[i], &buffer->pfds[i]);
+		}
+
+		buffer->stamp = epollfd->pollfds_stamp;
+	}
+
+	*pfds = buffer->pfds;
+	*nfds = cnt;
+	return 0;
+}
 
-	void *colliding_node =
-	    RB_INSERT(registered_fds_set_, &epollfd->registered_fds, fd2_node);
-	(void)colliding_node;
-	assert(colliding_node == NULL);
-	++epollfd->registered_fds_size;
+/*
+ * Unlike the harvest, the kevent changelist of epoll_ctl is still submitted
+ * with the mutex held. How its errors are handled depends on the node state
+ * (poll-only fallback, FIFOs without reader, nested eventfd kqueues), and a
+ * concurrent removal of the same fd could otherwise leave knotes pointing to
+ * freed nodes.
+ */
+errno_t
+epollfd_ctx_ctl(EpollFDCtx *epollfd, int op, int fd2, struct epoll_event *ev,
+    struct epoll_lowat const *lowat, EventFDCtx *fd2_eventfd,
+    FDContextMapNode *fd2_consume_node)
+{
+	errno_t ec;
 
-	errno_t ec = epollfd_ctx__register_events(epollfd, fd2_node);
-	if (ec != 0) {
-		epollfd_ctx_remove_node(epollfd, fd2_node);
-		return ec;
+	shim_mutex_lock(&epollfd->mutex);
+	ec = epollfd_ctx_ctl_impl(epollfd, op, fd2, ev, lowat, fd2_eventfd,
+	    fd2_consume_node);
+	shim_mutex_unlock(&epollfd->mutex);
+
+	return ec;
+}
+
+static void
+wait_slot_set_node(struct epoll_event *ev, struct epoll_event_ex *ev_ex, int i,
+    RegisteredFDsNode *fd2_node)
+{
+	if (ev_ex) {
+		ev_ex[i].data.ptr = fd2_node;
+	} else {
+		ev[i].data.ptr = fd2_node;
 	}
+}
 
-	fd2_node->is_registered = true;
+static RegisteredFDsNode *
+wait_slot_get_node(struct epoll_event *ev, struct epoll_event_ex *ev_ex, int i)
+{
+	return (RegisteredFDsNode *)(ev_ex ? ev_ex[i].data.ptr
+					   : ev[i].data.ptr);
+}
 
-	return 0;
+static void
+wait_slot_fill(struct epoll_event *ev, struct epoll_event_ex *ev_ex, int i,
+    RegisteredFDsNode *fd2_node)
+{
+	if (!ev_ex) {
+		ev[i].events = fd2_node->revents;
+		ev[i].data = fd2_node->data;
+		return;
+	}
+
+	ev_ex[i].events = fd2_node->revents;
+	ev_ex[i].data = fd2_node->data;
+	ev_ex[i].value = 0;
+	ev_ex[i].nreadable = fd2_node->revents_nreadable;
+	ev_ex[i].nwritable = fd2_node->revents_nwritable;
+	ev_ex[i].error = fd2_node->revents_error;
+
+	if (fd2_node->consume_node && (fd2_node->revents & EPOLLIN)) {
+		fd_context_map_node_ref(fd2_node->consume_node);
+		ev_ex[i].events |= EPOLLCONSUME;
+		ev_ex[i].value = (uint64_t)(uintptr_t)fd2_node->consume_node;
+	}
 }
 
-static errno_t
-epollfd_ctx_modify_node(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node,
-    struct epoll_event *ev)
+/*
+ * Kevents are retrieved without holding the epoll mutex. Tell if 'kev' still
+ * belongs to the current registration of 'fd2_node'.
+ */
+static bool
+registered_fds_node_is_kevent_current(RegisteredFDsNode *fd2_node,
+    struct kevent const *kev)
 {
-	registered_fds_node_update_flags_from_epoll_event(fd2_node, ev);
+	if (fd2_node->is_dead || fd2_node->is_disarmed) {
+		return false;
+	}
 
-	assert(fd2_node->is_registered);
+	if (fd2_node->node_type == NODE_TYPE_EVENTFD) {
+		return fd2_node->node_data.eventfd.is_attached;
+	}
 
-	errno_t ec = epollfd_ctx__register_events(epollfd, fd2_node);
-	if (ec != 0) {
-		epollfd_ctx_remove_node(epollfd, fd2_node);
-		return ec;
+	if (fd2_node->node_type == NODE_TYPE_POLL) {
+		return fd2_node->pollfd_index != 0;
 	}
 
-	return 0;
+#ifdef EVFILT_USER
+	if (kev->filter == EVFILT_USER) {
+#else
+	if (kev->ident == (uintptr_t)fd2_node) {
+#endif
+		/* Only FIFOs without a reader trigger themselves. */
+		return fd2_node->node_type == NODE_TYPE_FIFO &&
+		    !fd2_node->has_evfilt_read &&
+		    !fd2_node->has_evfilt_write &&
+		    !fd2_node->has_evfilt_except;
+	}
+
+	switch (kev->filter) {
+	case EVFILT_READ:
+		return fd2_node->has_evfilt_read;
+	case EVFILT_WRITE:
+		return fd2_node->has_evfilt_write;
+#ifdef EVFILT_EXCEPT
+	case EVFILT_EXCEPT:
+		return fd2_node->has_evfilt_except;
+#endif
+	default:
+		return false;
+	}
 }
 
-static errno_t
-epollfd_ctx_ctl_impl(EpollFDCtx *epollfd, int op, int fd2,
-    struct epoll_event *ev)
+static size_t
+epollfd_ctx__thread_shard(EpollFDCtx const *epollfd)
 {
-	assert(op == EPOLL_CTL_DEL || ev != NULL);
+	static atomic_uint nr_threads;
+	static _Thread_local bool has_thread_index;
+	static _Thread_local unsigned thread_index;
 
-	if (epollfd->kq == fd2) {
-		return EINVAL;
+	/* Spread the threads over the shards round robin. */
+	if (!has_thread_index) {
+		thread_index = atomic_fetch_add(&nr_threads, 1);
+		has_thread_index = true;
 	}
 
-	if (op != EPOLL_CTL_DEL &&
-	    ((ev->events &
-		~(uint32_t)(EPOLLIN | EPOLLOUT | EPOLLRDHUP | /**/
-		    EPOLLPRI | /* unsupported by FreeBSD's kqueue! */
-		    EPOLLHUP | EPOLLERR | /**/
-		    EPOLLET | EPOLLONESHOT)))) {
-		return EINVAL;
-	}
+	return thread_index % epollfd->nr_shards;
+}
 
-	RegisteredFDsNode *fd2_node;
-	{
-		RegisteredFDsNode find;
-		find.fd = fd2;
+/*
+ * Retrieves pending kevents without blocking. In sharded mode, the shard of
+ * the calling thread is harvested first, the other shards only if there is
+ * space left. Called without the epoll mutex held.
+ */
+static int
+epollfd_ctx__harvest_kevents(EpollFDCtx *epollfd, struct kevent *kevs,
+    int cnt)
+{
+	struct timespec const zero = {0, 0};
+	int n = 0;
 
-		fd2_node = RB_FIND(registered_fds_set_, /**/
-		    &epollfd->registered_fds, &find);
+	if (epollfd->nr_shards != 0) {
+		size_t first = epollfd_ctx__thread_shard(epollfd);
+
+		for (size_t i = 0; i < epollfd->nr_shards && n < cnt; ++i) {
+			int ret = kevent(epollfd->shard_kqs[/**/
+					     (first + i) % epollfd->nr_shards],
+			    NULL, 0, kevs + n, cnt - n, &zero);
+			if (ret < 0) {
+				return -1;
+			}
+			n += ret;
+		}
+
+		if (n == cnt) {
+			return n;
+		}
 	}
 
-	struct stat statbuf;
-	if (fstat(fd2, &statbuf) < 0) {
-		errno_t ec = errno;
+	int ret = kevent(epollfd->kq, NULL, 0, kevs + n, cnt - n, &zero);
+	if (ret < 0) {
+		return -1;
+	}
 
-		/* If the fstat fails for any reason we must clear
-		 * internal state to avoid EEXIST errors in future
-		 * calls to epoll_ctl. */
-		if (fd2_node) {
-			epollfd_ctx_remove_node(epollfd, fd2_node);
+	int end = n + ret;
+	for (int i = n; i < end; ++i) {
+		/*
+		 * Shard readiness is only there for pollers of the epoll fd.
+		 * As the knotes are level triggered, they are queued up
+		 * behind the other kevents on the next call.
+		 */
+		if ((void *)kevs[i].udata == (void *)epollfd) {
+			continue;
 		}
 
-		return ec;
+		kevs[n++] = kevs[i];
 	}
 
-	errno_t ec;
+	return n;
+}
 
-	if (op == EPOLL_CTL_ADD) {
-		ec = fd2_node
-		    ? EEXIST
-		    : epollfd_ctx_add_node(epollfd, fd2, ev, &statbuf);
-	} else if (op == EPOLL_CTL_DEL) {
-		ec = !fd2_node
-		    ? ENOENT
-		    : (epollfd_ctx_remove_node(epollfd, fd2_node), 0);
-	} else if (op == EPOLL_CTL_MOD) {
-		ec = !fd2_node
-		    ? ENOENT
-		    : epollfd_ctx_modify_node(epollfd, fd2_node, ev);
-	} else {
-		ec = EINVAL;
+static void
+epollfd_ctx__end_harvest(EpollFDCtx *epollfd)
+{
+	assert(epollfd->nr_harvesting > 0);
+
+	if (--epollfd->nr_harvesting != 0) {
+		return;
 	}
 
-	return ec;
+	RegisteredFDsNode *fd2_node;
+	while ((fd2_node = SLIST_FIRST(&epollfd->dead_nodes)) != NULL) {
+		SLIST_REMOVE_HEAD(&epollfd->dead_nodes, dead_entry);
+		registered_fds_node_destroy(fd2_node);
+	}
 }
 
-void
-epollfd_ctx_fill_pollfds(EpollFDCtx *epollfd, struct pollfd *pfds)
+/*
+ * Kevents that could not be reported are handed back to their kqueue, in
+ * one changelist per kqueue.
+ */
+typedef struct {
+	int kq;
+	int n;
+	struct kevent kevs[32];
+} RequeueBatch;
+
+static void
+requeue_batch_flush(RequeueBatch *batch)
 {
-	pfds[0] = (struct pollfd){.fd = epollfd->kq, .events = POLLIN};
+	if (batch->n > 0) {
+		(void)kevent(batch->kq, batch->kevs, batch->n, /**/
+		    batch->kevs, batch->n, NULL);
+		batch->n = 0;
+	}
+}
 
-	RegisteredFDsNode *poll_node;
-	size_t i = 1;
-	TAILQ_FOREACH(poll_node, &epollfd->poll_fds, pollfd_list_entry)
-	{
-		pfds[i++] = (struct pollfd){
-		    .fd = poll_node->fd,
-		    .events = poll_node->node_type == NODE_TYPE_POLL
-			? (short)poll_node->events
-			: POLLPRI,
-		};
+static void
+requeue_batch_add(RequeueBatch *batch, int kq, struct kevent const *kev)
+{
+	if (batch->n == (int)(sizeof(batch->kevs) / sizeof(batch->kevs[0])) ||
+	    (batch->n > 0 && batch->kq != kq)) {
+		requeue_batch_flush(batch);
 	}
+
+	batch->kq = kq;
+	batch->kevs[batch->n] = *kev;
+	batch->kevs[batch->n].flags |= EV_RECEIPT;
+	++batch->n;
 }
 
-errno_t
-epollfd_ctx_ctl(EpollFDCtx *epollfd, int op, int fd2, struct epoll_event *ev)
+/*
+ * Only the knote that fired is touched. Level triggered knotes stay active
+ * and fire again by themselves. Others are added again, which re-evaluates
+ * their filter.
+ */
+static void
+epollfd_ctx__requeue_kevent(EpollFDCtx *epollfd, RegisteredFDsNode *fd2_node,
+    struct kevent const *kev, RequeueBatch *batch)
 {
-	errno_t ec;
+	struct kevent nkev;
 
-	(void)pthread_mutex_lock(&epollfd->mutex);
-	ec = epollfd_ctx_ctl_impl(epollfd, op, fd2, ev);
-	(void)pthread_mutex_unlock(&epollfd->mutex);
+#ifdef EVFILT_USER
+	if (kev->filter == EVFILT_USER) {
+		/* Eventfd watches and self triggers just trigger again. */
+		EV_SET(&nkev, kev->ident, EVFILT_USER, 0, NOTE_TRIGGER, 0,
+		    fd2_node);
+		requeue_batch_add(batch, epollfd->kq, &nkev);
+		return;
+	}
+#else
+	if (kev->ident == (uintptr_t)fd2_node) {
+		registered_fds_node_trigger_self(fd2_node, epollfd);
+		return;
+	}
+#endif
 
-	return ec;
+	unsigned short flags;
+	unsigned int fflags;
+	intptr_t data;
+
+	if (kev->filter == EVFILT_READ) {
+		flags = fd2_node->evfilt_read_flags;
+		fflags = lowat_fflags(fd2_node->rcvlowat);
+		data = fd2_node->rcvlowat;
+	} else if (kev->filter == EVFILT_WRITE) {
+		flags = fd2_node->evfilt_write_flags;
+		fflags = lowat_fflags(fd2_node->sndlowat);
+		data = fd2_node->sndlowat;
+#ifdef EVFILT_EXCEPT
+	} else if (kev->filter == EVFILT_EXCEPT) {
+		flags = fd2_node->evfilt_except_flags;
+		fflags = NOTE_OOB;
+		data = 0;
+#endif
+	} else {
+		return;
+	}
+
+	/* Neither EV_CLEAR nor EV_DISPATCH. */
+	if (flags == 0) {
+		return;
+	}
+
+	EV_SET(&nkev, kev->ident, kev->filter, EV_ADD | EV_ENABLE | flags,
+	    fflags, data, fd2_node);
+	requeue_batch_add(batch, registered_fds_node_kq(fd2_node, epollfd),
+	    &nkev);
 }
 
 static errno_t
-epollfd_ctx_wait_impl(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
-    int *actual_cnt)
+epollfd_ctx_wait_impl(EpollFDCtx *epollfd, struct epoll_event *ev,
+    struct epoll_event_ex *ev_ex, int cnt, int *actual_cnt)
 {
 	errno_t ec;
 
 	assert(cnt >= 1);
 
-	ec = epollfd_ctx_make_pfds_space(epollfd);
+	ec = epollfd_ctx_make_pfds_space(epollfd, 1 + epollfd->poll_fds_size);
 	if (ec != 0) {
 		return ec;
 	}
 
-	epollfd_ctx_fill_pollfds(epollfd, epollfd->pfds);
+	/*
+	 * Check the kqueue and the poll-only fds in one go. Here, poll-only
+	 * fds are polled for their full readiness so that drained edge
+	 * triggered fds are noticed.
+	 */
+	epollfd->pfds[0] = (struct pollfd){.fd = epollfd->kq, .events = POLLIN};
+	size_t nfds = 1 + epollfd->nr_checked_poll_fds;
 
-	int n = poll(epollfd->pfds, (nfds_t)(1 + epollfd->poll_fds_size), 0);
+	int n = poll(epollfd->pfds, (nfds_t)nfds, 0);
 	if (n < 0) {
 		return errno;
 	}
-	if (n == 0) {
+	if (n == 0
+#ifndef EVFILT_USER
+	    && TAILQ_EMPTY(&epollfd->triggered_nodes)
+#endif
+	) {
 		*actual_cnt = 0;
 		return 0;
 	}
 
-	{
-		RegisteredFDsNode *poll_node, *tmp_poll_node;
-		size_t i = 1;
-		TAILQ_FOREACH_SAFE(poll_node, &epollfd->poll_fds,
-		    pollfd_list_entry, tmp_poll_node)
-		{
-			struct pollfd *pfd = &epollfd->pfds[i++];
-
-			if (pfd->revents & POLLNVAL) {
+	if (nfds > 1) {
+		bool poll_set_changed = false;
+		int nr_ready = n - (epollfd->pfds[0].revents != 0);
+
+		for (size_t i = 1; nr_ready > 0; ++i) {
+			i = pollfds_next_ready(epollfd->pfds, i, nfds);
+			if (i == nfds) {
+				break;
+			}
+			--nr_ready;
+
+			RegisteredFDsNode *poll_node = epollfd->pfd_nodes[i];
+			uint32_t revents = (uint32_t)epollfd->pfds[i].revents;
+
+			if (revents & POLLNVAL) {
+				/* The last checked entry moves here. */
 				epollfd_ctx_remove_node(epollfd, poll_node);
-			} else if (pfd->revents) {
+				++epollfd->nr_evictions;
+				--nfds;
+				--i;
+				continue;
+			}
+
+			if (poll_node->is_edge_triggered) {
+				/* Drained readiness may be reported again. */
+				if (poll_node->poll_revents & ~revents) {
+					poll_node->poll_revents &= revents;
+					epollfd_ctx__update_pollfd(epollfd,
+					    poll_node);
+					poll_set_changed = true;
+				}
+
+				revents &= ~poll_node->poll_revents;
+			}
+
+			if (revents) {
 				registered_fds_node_trigger_self(poll_node,
 				    epollfd);
 			}
+
+			if (poll_node->pollfd_index != i) {
+				/* It left the checked entries, another one
+				 * took its place. */
+				--nfds;
+				--i;
+			}
+		}
+
+		if (poll_set_changed && epollfd->use_poller_thread) {
+			epollfd_ctx__wake_poller_thread(epollfd);
 		}
 	}
 
@@ -1244,33 +2776,88 @@ again:;
 	 * the provided space in 'ev' is large enough to hold results
 	 * for all registered fds, provide enough space for the kevent
 	 * call as well. Add some wiggle room for the 'poll only fd'
-	 * notification mechanism.
+	 * notification mechanism. Registrations may be added while the
+	 * kevents are retrieved, so 'cnt' still bounds the reported events.
 	 */
-	if ((size_t)cnt >= epollfd->registered_fds_size) {
-		if (__builtin_add_overflow(cnt, 1, &cnt)) {
+	int kevs_cnt = cnt;
+	if ((size_t)kevs_cnt >= epollfd->registered_fds_size) {
+		if (__builtin_add_overflow(kevs_cnt, 1, &kevs_cnt)) {
 			return ENOMEM;
 		}
-		if (__builtin_mul_overflow(cnt, 3, &cnt)) {
+		if (__builtin_mul_overflow(kevs_cnt, 3, &kevs_cnt)) {
 			return ENOMEM;
 		}
 	}
 
-	ec = epollfd_ctx_make_kevs_space(epollfd, (size_t)cnt);
+	struct kevent *kevs;
+	size_t kevs_length;
+	ec = kevent_buffer_acquire((size_t)kevs_cnt, &kevs, &kevs_length);
 	if (ec != 0) {
 		return ec;
 	}
+	kevs_cnt = (int)kevs_length;
+
+	int nr_self_triggered = 0;
+#ifndef EVFILT_USER
+	{
+		RegisteredFDsNode *fd2_node;
+		while (nr_self_triggered < kevs_cnt &&
+		    (fd2_node = TAILQ_FIRST(&epollfd->triggered_nodes))) {
+			TAILQ_REMOVE(&epollfd->triggered_nodes, fd2_node,
+			    trigger_entry);
+			fd2_node->is_self_triggered = false;
+
+			EV_SET(&kevs[nr_self_triggered++], (uintptr_t)fd2_node,
+			    EVFILT_READ, 0, 0, 0, fd2_node);
+		}
+	}
+#endif
+
+	/*
+	 * Let epoll_ctl and other waiters proceed while the kqueue is
+	 * queried. Nodes stay allocated until the harvest has ended.
+	 */
+	++epollfd->nr_harvesting;
+	shim_mutex_unlock(&epollfd->mutex);
 
-	struct kevent *kevs = epollfd->kevs;
-	assert(kevs != NULL);
+	n = epollfd_ctx__harvest_kevents(epollfd, kevs + nr_self_triggered,
+	    kevs_cnt - nr_self_triggered);
+	ec = n < 0 ? errno : 0;
+
+	shim_mutex_lock(&epollfd->mutex);
 
-	n = kevent(epollfd->kq, NULL, 0, kevs, cnt, &(struct timespec){0, 0});
 	if (n < 0) {
-		return errno;
+		epollfd_ctx__end_harvest(epollfd);
+		kevent_buffer_release();
+		return ec;
+	}
+	n += nr_self_triggered;
+
+	/* Drop kevents of registrations that changed in the meantime. */
+	int nr_kevs = 0;
+	for (int i = 0; i < n; ++i) {
+		RegisteredFDsNode *fd2_node =
+		    (RegisteredFDsNode *)kevs[i].udata;
+
+		if (fd2_node &&
+		    !registered_fds_node_is_kevent_current(fd2_node,
+			&kevs[i])) {
+			continue;
+		}
+
+		kevs[nr_kevs++] = kevs[i];
 	}
 
+	epollfd_ctx__end_harvest(epollfd);
+
+	size_t nr_probes = epollfd_ctx__probe_nodes(epollfd, kevs, nr_kevs);
+
 	int j = 0;
+	bool wake_poller_thread = false;
+	bool retrigger_self = false;
+	RequeueBatch requeue_batch = {.n = 0};
 
-	for (int i = 0; i < n; ++i) {
+	for (int i = 0; i < nr_kevs; ++i) {
 		RegisteredFDsNode *fd2_node =
 		    (RegisteredFDsNode *)kevs[i].udata;
 
@@ -1279,8 +2866,36 @@ again:;
 			assert(kevs[i].filter == EVFILT_USER);
 #else
 			assert(kevs[i].filter == EVFILT_READ);
+
+			/* The kevent tells how many bytes are queued, so no
+			 * read has to fail with EAGAIN. */
+			char c[32];
+			intptr_t left = (intptr_t)kevs[i].data;
+			while (left > 0) {
+				size_t len = (size_t)left < sizeof(c)
+				    ? (size_t)left
+				    : sizeof(c);
+				ssize_t r = read(epollfd->self_pipe[0], c, len);
+				if (r <= 0) {
+					break;
+				}
+				left -= r;
+			}
 #endif
 			assert(kevs[i].udata == 0);
+
+			/* Another thread might have taken the wakeup meant
+			 * for a stale poller. */
+			if (atomic_load(&epollfd->nr_stale_polling_threads)) {
+				retrigger_self = true;
+			}
+			continue;
+		}
+
+		if (j == cnt && fd2_node->revents == 0) {
+			/* No slot is left, report it on a later wait. */
+			epollfd_ctx__requeue_kevent(epollfd, fd2_node,
+			    &kevs[i], &requeue_batch);
 			continue;
 		}
 
@@ -1290,7 +2905,14 @@ again:;
 
 		registered_fds_node_feed_event(fd2_node, epollfd, &kevs[i]);
 
+		if (fd2_node->is_poller_triggered) {
+			/* Let the poller thread watch the fd again. */
+			fd2_node->is_poller_triggered = false;
+			wake_poller_thread = true;
+		}
+
 		if (fd2_node->node_type != NODE_TYPE_POLL &&
+		    fd2_node->node_type != NODE_TYPE_EVENTFD &&
 		    !(fd2_node->is_edge_triggered &&
 			fd2_node->eof_state ==
 			    (EOF_STATE_READ_EOF | EOF_STATE_WRITE_EOF) &&
@@ -1313,18 +2935,20 @@ again:;
 		}
 
 		if (fd2_node->revents && !old_revents) {
-			ev[j++].data.ptr = fd2_node;
+			wait_slot_set_node(ev, ev_ex, j++, fd2_node);
 		}
 	}
 
+	requeue_batch_flush(&requeue_batch);
+
 	{
 		int completion_kq = -1;
 
 		for (int i = 0; i < j; ++i) {
 			RegisteredFDsNode *fd2_node =
-			    (RegisteredFDsNode *)ev[i].data.ptr;
+			    wait_slot_get_node(ev, ev_ex, i);
 
-			if (n == cnt || fd2_node->is_edge_triggered) {
+			if (n == kevs_cnt || fd2_node->is_edge_triggered) {
 				registered_fds_node_register_for_completion(
 				    &completion_kq, fd2_node);
 			}
@@ -1334,22 +2958,51 @@ again:;
 	}
 
 	for (int i = 0; i < j; ++i) {
-		RegisteredFDsNode *fd2_node =
-		    (RegisteredFDsNode *)ev[i].data.ptr;
+		RegisteredFDsNode *fd2_node = wait_slot_get_node(ev, ev_ex, i);
 
-		ev[i].events = fd2_node->revents;
-		ev[i].data = fd2_node->data;
+		wait_slot_fill(ev, ev_ex, i, fd2_node);
 
 		fd2_node->revents = 0;
+		fd2_node->revents_nreadable = -1;
+		fd2_node->revents_nwritable = -1;
+		fd2_node->revents_error = 0;
 		fd2_node->got_evfilt_read = false;
 		fd2_node->got_evfilt_write = false;
 		fd2_node->got_evfilt_except = false;
 
 		if (fd2_node->is_oneshot) {
-			epollfd_ctx__remove_node_from_kq(epollfd, fd2_node);
+			epollfd_ctx__disarm_oneshot_node(epollfd, fd2_node);
+		} else if (fd2_node->node_type == NODE_TYPE_EVENTFD &&
+		    !fd2_node->is_edge_triggered &&
+		    atomic_load(
+			&fd2_node->node_data.eventfd.watch->is_readable)) {
+			/* Level triggered: Report again on the next wait. */
+			registered_fds_node_trigger_eventfd(fd2_node, epollfd);
 		}
 	}
 
+	/* All probes should have been used up, but do not keep stale ones. */
+	for (size_t i = 0; i < nr_probes; ++i) {
+		epollfd->probe_nodes[i]->has_probe_revents = false;
+	}
+
+	if (wake_poller_thread) {
+		epollfd_ctx__wake_poller_thread(epollfd);
+	}
+
+#ifndef EVFILT_USER
+	/* The pipe has been drained, announce what did not fit. */
+	if (!TAILQ_EMPTY(&epollfd->triggered_nodes)) {
+		retrigger_self = true;
+	}
+#endif
+
+	if (retrigger_self) {
+		epollfd_ctx__trigger_self(epollfd);
+	}
+
+	kevent_buffer_release();
+
 	if (n && j == 0) {
 		goto again;
 	}
@@ -1359,14 +3012,90 @@ again:;
 }
 
 errno_t
-epollfd_ctx_wait(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
-    int *actual_cnt)
+epollfd_ctx_wait(EpollFDCtx *epollfd, struct epoll_event *ev,
+    struct epoll_event_ex *ev_ex, int cnt, int *actual_cnt)
 {
 	errno_t ec;
 
-	(void)pthread_mutex_lock(&epollfd->mutex);
-	ec = epollfd_ctx_wait_impl(epollfd, ev, cnt, actual_cnt);
-	(void)pthread_mutex_unlock(&epollfd->mutex);
+	assert((ev == NULL) != (ev_ex == NULL));
+
+	shim_mutex_lock(&epollfd->mutex);
+	ec = epollfd_ctx_wait_impl(epollfd, ev, ev_ex, cnt, actual_cnt);
+	shim_mutex_unlock(&epollfd->mutex);
 
 	return ec;
 }
+
+unsigned long
+epollfd_ctx_begin_polling(EpollFDCtx *epollfd)
+{
+	return (unsigned long)(atomic_fetch_add(&epollfd->polling_state, 1) >>
+	    32);
+}
+
+void
+epollfd_ctx_end_polling(EpollFDCtx *epollfd, unsigned long generation)
+{
+	uint_least64_t state = atomic_load(&epollfd->polling_state);
+	while ((state >> 32) == generation) {
+		if (atomic_compare_exchange_weak(&epollfd->polling_state,
+			&state, state - 1)) {
+			return;
+		}
+	}
+
+	atomic_fetch_sub(&epollfd->nr_stale_polling_threads, 1);
+}
+
+bool
+epollfd_ctx_may_be_registered(int fd2)
+{
+	unsigned int i = (unsigned int)fd2 % EPOLLFD_CTX_NR_FD_BUCKETS;
+
+	return atomic_load_explicit(&nr_registrations_by_fd_bucket[i],
+		   memory_order_relaxed) != 0;
+}
+
+void
+epollfd_ctx_evict_fd(EpollFDCtx *epollfd, int fd2)
+{
+	/*
+	 * The closing thread may not be the one that owns the epoll. Its
+	 * stale registration is noticed when the fd turns out to be invalid.
+	 */
+	if (epollfd->flags & EPOLLFD_CTX_FLAG_SINGLE_THREADED) {
+		return;
+	}
+
+	/* Most instances never saw the fd, leave their mutex alone. */
+	if (atomic_load_explicit(epollfd_ctx__fd_bucket(epollfd, fd2),
+		memory_order_relaxed) == 0) {
+		return;
+	}
+
+	shim_mutex_lock(&epollfd->mutex);
+
+	RegisteredFDsNode find;
+	find.fd = fd2;
+
+	RegisteredFDsNode *fd2_node = RB_FIND(registered_fds_set_, /**/
+	    &epollfd->registered_fds, &find);
+	if (fd2_node) {
+		(void)epollfd_ctx_remove_node(epollfd, fd2_node);
+		++epollfd->nr_evictions;
+	}
+
+	shim_mutex_unlock(&epollfd->mutex);
+}
+
+unsigned long
+epollfd_ctx_nr_evictions(EpollFDCtx *epollfd)
+{
+	unsigned long nr_evictions;
+
+	shim_mutex_lock(&epollfd->mutex);
+	nr_evictions = epollfd->nr_evictions;
+	shim_mutex_unlock(&epollfd->mutex);
+
+	return nr_evictions;
+}
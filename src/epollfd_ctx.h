@@ -7,6 +7,7 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -14,9 +15,14 @@
 #include <poll.h>
 #include <pthread.h>
 
+#include "eventfd_ctx.h"
+#include "shim_mutex.h"
+
 struct registered_fds_node_;
 typedef struct registered_fds_node_ RegisteredFDsNode;
 
+struct fd_context_map_node_;
+
 typedef enum {
 	EOF_STATE_READ_EOF = 0x01,
 	EOF_STATE_WRITE_EOF = 0x02,
@@ -28,21 +34,30 @@ typedef enum {
 	NODE_TYPE_KQUEUE = 3,
 	NODE_TYPE_OTHER = 4,
 	NODE_TYPE_POLL = 5,
+	NODE_TYPE_EVENTFD = 6,
 } NodeType;
 
 struct registered_fds_node_ {
 	RB_ENTRY(registered_fds_node_) entry;
-	TAILQ_ENTRY(registered_fds_node_) pollfd_list_entry;
+	TAILQ_ENTRY(registered_fds_node_) trigger_entry;
+	SLIST_ENTRY(registered_fds_node_) dead_entry;
 
 	int fd;
 	epoll_data_t data;
 
 	bool is_registered;
+	/* Removed, but kevents referring to it may still be in flight. */
+	bool is_dead;
 
 	bool has_evfilt_read;
 	bool has_evfilt_write;
 	bool has_evfilt_except;
 
+	/* The EV_CLEAR and EV_DISPATCH flags the knotes were added with. */
+	unsigned short evfilt_read_flags;
+	unsigned short evfilt_write_flags;
+	unsigned short evfilt_except_flags;
+
 	bool got_evfilt_read;
 	bool got_evfilt_write;
 	bool got_evfilt_except;
@@ -53,6 +68,10 @@ struct registered_fds_node_ {
 			bool readable;
 			bool writable;
 		} fifo;
+		struct {
+			EventFDWatch *watch;
+			bool is_attached;
+		} eventfd;
 	} node_data;
 	int eof_state;
 	bool pollpri_active;
@@ -60,47 +79,172 @@ struct registered_fds_node_ {
 	uint16_t events;
 	uint32_t revents;
 
+	/* 'data'/'fflags' of the last kevents, for epoll_wait_ex. */
+	int64_t revents_nreadable;
+	int64_t revents_nwritable;
+	int revents_error;
+
 	bool is_edge_triggered;
 	bool is_oneshot;
+	bool is_disarmed;
 
-	bool is_on_pollfd_list;
-	int self_pipe[2];
+	/* EPOLLCONSUME: Owning reference to the shimmed fd's context. */
+	struct fd_context_map_node_ *consume_node;
+
+	int rcvlowat;
+	int sndlowat;
+
+	/* Index into 'pfds' of the epoll for poll-only fds, or zero. */
+	size_t pollfd_index;
+	bool is_poller_triggered;
+	/* Poll-only fds: Readiness last observed, for EPOLLET. */
+	uint32_t poll_revents;
+	bool is_self_triggered;
+
+	/* Result of the batched poll probe of the current harvest. */
+	bool has_probe_revents;
+	short probe_revents;
 };
 
-typedef TAILQ_HEAD(pollfds_list_, registered_fds_node_) PollFDList;
 typedef RB_HEAD(registered_fds_set_, registered_fds_node_) RegisteredFDsSet;
 
+#define EPOLLFD_CTX_MAX_SHARDS 16
+#define EPOLLFD_CTX_NR_FD_BUCKETS 256
+
+#define EPOLLFD_CTX_FLAG_POLLER_THREAD (1 << 0)
+#define EPOLLFD_CTX_FLAG_SHARDED (1 << 1)
+#define EPOLLFD_CTX_FLAG_SINGLE_THREADED (1 << 2)
+
 typedef struct {
 	int kq; // non owning
-	pthread_mutex_t mutex;
+	int flags;
+	ShimMutex mutex;
+
+	/*
+	 * In sharded mode, the fd knotes are spread over 'nr_shards' extra
+	 * kqueues whose readiness is registered with 'kq'. Waiters harvest
+	 * the shard of their thread first.
+	 */
+	int *shard_kqs;
+	size_t nr_shards;
 
-	PollFDList poll_fds;
-	size_t poll_fds_size;
 
 	RegisteredFDsSet registered_fds;
 	size_t registered_fds_size;
 
-	struct kevent *kevs;
-	size_t kevs_length;
-
+	/*
+	 * Number of registrations per fd bucket. Changes happen with 'mutex'
+	 * held, but evictions read it without, to skip instances that cannot
+	 * have the fd.
+	 */
+	atomic_uint nr_registrations_by_fd_bucket[EPOLLFD_CTX_NR_FD_BUCKETS];
+
+	/*
+	 * Waiters retrieve kevents without holding 'mutex'. Nodes removed
+	 * meanwhile are kept on 'dead_nodes' until the last retrieval is
+	 * done.
+	 */
+	unsigned long nr_harvesting;
+	SLIST_HEAD(dead_nodes_, registered_fds_node_) dead_nodes;
+
+	/*
+	 * The kqueue followed by the 'poll_fds_size' poll-only fds.
+	 * 'pfd_nodes' maps the entries back to their nodes. Entries that do
+	 * not have to be checked by waiters have a negative (complemented)
+	 * fd, so poll ignores them. They come after the checked ones.
+	 * 'pollfds_stamp' changes with every update of the poll set.
+	 */
 	struct pollfd *pfds;
+	RegisteredFDsNode **pfd_nodes;
 	size_t pfds_length;
-
-	pthread_mutex_t nr_polling_threads_mutex;
-	pthread_cond_t nr_polling_threads_cond;
-	unsigned long nr_polling_threads;
+	size_t poll_fds_size;
+	size_t nr_checked_poll_fds;
+	uint_least64_t pollfds_stamp;
+
+	/* Scratch space for the poll probes of a harvest. */
+	struct pollfd *probe_pfds;
+	RegisteredFDsNode **probe_nodes;
+	size_t probe_length;
+
+	/*
+	 * Threads blocked in ppoll on the current version of the poll set
+	 * and on older ones. The version is kept in the upper 32 bits of
+	 * 'polling_state', next to the count of its threads, so that both
+	 * change together without locking. While stale threads exist, the
+	 * self trigger is kept active.
+	 */
+	atomic_uint_least64_t polling_state;
+	atomic_ulong nr_stale_polling_threads;
+
+	/*
+	 * With a poller thread, poll-only fds are polled by a helper thread
+	 * that triggers their nodes. Waiters only have to wait on the kqueue.
+	 */
+	bool use_poller_thread;
+	bool has_poller_thread;
+	bool poller_thread_quit;
+	pthread_t poller_thread;
+	unsigned long poll_fds_generation;
+	int poller_pipe[2];
+
+	/* Registrations removed because their fd was closed. */
+	unsigned long nr_evictions;
+
+	/*
+	 * Without EVFILT_USER, nodes trigger themselves by queueing up here.
+	 * The 'self_pipe' is written when the queue becomes non-empty.
+	 */
+	TAILQ_HEAD(triggered_nodes_, registered_fds_node_) triggered_nodes;
 
 	int self_pipe[2];
 } EpollFDCtx;
 
-errno_t epollfd_ctx_init(EpollFDCtx *epollfd, int kq);
+errno_t epollfd_ctx_init(EpollFDCtx *epollfd, int kq, int flags);
 errno_t epollfd_ctx_terminate(EpollFDCtx *epollfd);
 
-void epollfd_ctx_fill_pollfds(EpollFDCtx *epollfd, struct pollfd *pfds);
-
+/*
+ * Returns the pollfds a blocking waiter has to ppoll on. They live in a
+ * buffer of the calling thread that is only refilled when the poll set has
+ * changed since. Must be called with the epoll mutex held.
+ */
+errno_t epollfd_ctx_blocking_pollfds(EpollFDCtx *epollfd,
+    struct pollfd **pfds, size_t *nfds);
+
+/*
+ * If 'fd2_eventfd' is not NULL, 'fd2' refers to that shimmed eventfd and may
+ * be attached directly to the epoll's kqueue. EPOLLCONSUME registrations
+ * need the context of the shimmed 'fd2' in 'fd2_consume_node' and keep a
+ * reference to it.
+ */
 errno_t epollfd_ctx_ctl(EpollFDCtx *epollfd, int op, int fd2,
-    struct epoll_event *ev);
-errno_t epollfd_ctx_wait(EpollFDCtx *epollfd, struct epoll_event *ev, int cnt,
-    int *actual_cnt);
+    struct epoll_event *ev, struct epoll_lowat const *lowat,
+    EventFDCtx *fd2_eventfd, struct fd_context_map_node_ *fd2_consume_node);
+/*
+ * Exactly one of 'ev' and 'ev_ex' must be non-NULL. Events of EPOLLCONSUME
+ * registrations are returned in 'ev_ex' with EPOLLCONSUME still set and a
+ * new reference to the context to consume in 'value'. The caller must
+ * consume them and drop the reference.
+ */
+errno_t epollfd_ctx_wait(EpollFDCtx *epollfd, struct epoll_event *ev,
+    struct epoll_event_ex *ev_ex, int cnt, int *actual_cnt);
+
+/*
+ * Bracket a ppoll on the pollfds from 'epollfd_ctx_blocking_pollfds'. The
+ * first must be called with the epoll mutex held, the second does not
+ * lock.
+ */
+unsigned long epollfd_ctx_begin_polling(EpollFDCtx *epollfd);
+void epollfd_ctx_end_polling(EpollFDCtx *epollfd, unsigned long generation);
+
+/* Drops the registration of 'fd2' (if any), which is about to be closed. */
+void epollfd_ctx_evict_fd(EpollFDCtx *epollfd, int fd2);
+
+/*
+ * Tells without locking if any epoll instance may have a registration of
+ * 'fd2'. False negatives are only possible for registrations that race with
+ * the caller.
+ */
+bool epollfd_ctx_may_be_registered(int fd2);
+unsigned long epollfd_ctx_nr_evictions(EpollFDCtx *epollfd);
 
 #endif
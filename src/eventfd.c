@@ -23,17 +23,8 @@ static errno_t
 eventfd_ctx_read_or_block(EventFDCtx *eventfd_ctx, uint64_t *value,
     bool nonblock)
 {
-	for (;;) {
-		errno_t ec = eventfd_ctx_read(eventfd_ctx, value);
-		if (nonblock || ec != EAGAIN) {
-			return (ec);
-		}
-
-		struct pollfd pfd = {.fd = eventfd_ctx->kq_, .events = POLLIN};
-		if (poll(&pfd, 1, -1) < 0) {
-			return (errno);
-		}
-	}
+	return nonblock ? eventfd_ctx_read(eventfd_ctx, value)
+			: eventfd_ctx_read_blocking(eventfd_ctx, value);
 }
 
 static errno_t
@@ -82,12 +73,25 @@ eventfd_close(FDContextMapNode *node)
 	return eventfd_ctx_terminate(&node->ctx.eventfd);
 }
 
+static errno_t
+eventfd_consume(FDContextMapNode *node, uint64_t *value)
+{
+	return eventfd_ctx_read(&node->ctx.eventfd, value);
+}
+
 static FDContextVTable const eventfd_vtable = {
     .read_fun = eventfd_helper_read,
     .write_fun = eventfd_helper_write,
     .close_fun = eventfd_close,
+    .consume_fun = eventfd_consume,
 };
 
+EventFDCtx *
+fd_context_map_node_eventfd(FDContextMapNode *node)
+{
+	return node->vtable == &eventfd_vtable ? &node->ctx.eventfd : NULL;
+}
+
 static FDContextMapNode *
 eventfd_impl(unsigned int initval, int flags, errno_t *ec)
 {
@@ -161,3 +165,25 @@ eventfd_write(int fd, eventfd_t value)
 	    ? 0
 	    : -1;
 }
+
+int
+eventfd_write_h(struct epoll_shim_handle *handle, eventfd_t value)
+{
+	FDContextMapNode *node = (FDContextMapNode *)handle;
+
+	errno_t ec;
+	if (!node) {
+		ec = EBADF;
+	} else if (node->vtable != &eventfd_vtable) {
+		ec = EINVAL;
+	} else {
+		ec = eventfd_ctx_write(&node->ctx.eventfd, value);
+	}
+
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return 0;
+}
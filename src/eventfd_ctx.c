@@ -9,8 +9,12 @@
 #include <errno.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h>
 
+#include "futex.h"
+
 #ifndef nitems
 #define nitems(x) (sizeof((x)) / sizeof((x)[0]))
 #endif
@@ -27,12 +31,11 @@ eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter, int flags)
 	*eventfd = (EventFDCtx){
 	    .kq_ = kq,
 	    .flags_ = flags,
-	    .counter_ = counter,
 	};
-
-	if ((ec = pthread_mutex_init(&eventfd->mutex_, NULL)) != 0) {
-		return ec;
-	}
+	atomic_init(&eventfd->counter_, counter);
+	atomic_init(&eventfd->wake_seq_, 0);
+	atomic_init(&eventfd->nr_waiters_, 0);
+	atomic_init(&eventfd->watch_, NULL);
 
 	struct kevent kevs[2];
 	int kevs_length = 0;
@@ -47,8 +50,7 @@ eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter, int flags)
 	}
 #else
 	if (pipe2(eventfd->self_pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
-		ec = errno;
-		goto out2;
+		return (errno);
 	}
 
 	EV_SET(&kevs[kevs_length++], /**/
@@ -69,24 +71,42 @@ eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter, int flags)
 		goto out;
 	}
 
-	eventfd->is_signalled_ = !!(counter > 0);
-
 	return (0);
 
 out:
 #ifndef EVFILT_USER
 	(void)close(eventfd->self_pipe_[0]);
 	(void)close(eventfd->self_pipe_[1]);
-out2:
 #endif
-	pthread_mutex_destroy(&eventfd->mutex_);
 	return (ec);
 }
 
 errno_t
 eventfd_ctx_terminate(EventFDCtx *eventfd)
 {
-	errno_t ec = pthread_mutex_destroy(&eventfd->mutex_);
+	errno_t ec = 0;
+
+	EventFDWatch *watch = atomic_load(&eventfd->watch_);
+	if (watch) {
+		atomic_store(&watch->is_readable, false);
+
+		atomic_fetch_add(&watch->nr_kq_users, 1);
+		int kq = atomic_exchange(&watch->kq, -1);
+#ifdef EVFILT_USER
+		if (kq >= 0) {
+			struct kevent kevs[1];
+			EV_SET(&kevs[0], (uintptr_t)watch, EVFILT_USER, /**/
+			    EV_DELETE, 0, 0, 0);
+			(void)kevent(kq, kevs, nitems(kevs), NULL, 0, NULL);
+		}
+#else
+		(void)kq;
+#endif
+		atomic_fetch_sub(&watch->nr_kq_users, 1);
+
+		eventfd_watch_release(watch);
+	}
+
 #ifndef EVFILT_USER
 	if (close(eventfd->self_pipe_[0]) < 0) {
 		ec = ec != 0 ? ec : errno;
@@ -99,109 +119,295 @@ eventfd_ctx_terminate(EventFDCtx *eventfd)
 }
 
 static errno_t
-eventfd_ctx_write_impl(EventFDCtx *eventfd, uint64_t value)
+eventfd_ctx_trigger(EventFDCtx *eventfd)
 {
-	if (value == UINT64_MAX) {
-		return (EINVAL);
+#ifdef EVFILT_USER
+	struct kevent kevs[1];
+	EV_SET(&kevs[0], 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+
+	if (kevent(eventfd->kq_, kevs, nitems(kevs), NULL, 0, NULL) < 0) {
+		return (errno);
+	}
+#else
+	char c = 0;
+	if (write(eventfd->self_pipe_[1], &c, 1) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return (errno);
+		}
 	}
+#endif
 
-	uint_least64_t current_value = eventfd->counter_;
+	return (0);
+}
 
-	uint_least64_t new_value;
-	if (__builtin_add_overflow(current_value, value, &new_value) ||
-	    new_value > UINT64_MAX - 1) {
-		return (EAGAIN);
+/* Async-signal-safe. */
+static void
+eventfd_ctx_signal_watch(EventFDCtx *eventfd)
+{
+	EventFDWatch *watch = atomic_load(&eventfd->watch_);
+	if (!watch) {
+		return;
 	}
 
-	eventfd->counter_ = new_value;
+	atomic_store(&watch->is_readable, true);
 
-	if (!eventfd->is_signalled_) {
 #ifdef EVFILT_USER
+	/* Announce the use before loading the kq, see the detach. */
+	atomic_fetch_add(&watch->nr_kq_users, 1);
+
+	int kq = atomic_load(&watch->kq);
+	if (kq >= 0) {
+		int const saved_errno = errno;
+
 		struct kevent kevs[1];
-		EV_SET(&kevs[0], 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+		EV_SET(&kevs[0], (uintptr_t)watch, EVFILT_USER, /**/
+		    0, NOTE_TRIGGER, 0, 0);
+		(void)kevent(kq, kevs, nitems(kevs), NULL, 0, NULL);
 
-		if (kevent(eventfd->kq_, kevs, nitems(kevs), /**/
-			NULL, 0, NULL) < 0) {
-			return (errno);
-		}
-#else
-		char c = 0;
-		if (write(eventfd->self_pipe_[1], &c, 1) < 0) {
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				return (errno);
-			}
-		}
+		errno = saved_errno;
+	}
+
+	atomic_fetch_sub(&watch->nr_kq_users, 1);
 #endif
-		eventfd->is_signalled_ = true;
+}
+
+static void
+eventfd_ctx_unsignal_watch(EventFDCtx *eventfd)
+{
+	EventFDWatch *watch = atomic_load(&eventfd->watch_);
+	if (watch) {
+		atomic_store(&watch->is_readable, false);
+	}
+}
+
+/*
+ * The eventfd's kqueue holds exactly one EV_CLEAR knote, so retrieving a
+ * single event resets readiness. There is no need to loop until kevent(2)
+ * returns zero.
+ */
+static errno_t
+eventfd_ctx_drain(EventFDCtx *eventfd)
+{
+	struct kevent kevs[1];
+
+#ifndef EVFILT_USER
+	/*
+	 * Only zero to non-zero transitions write to the pipe, so a single
+	 * read practically always empties it. Leftover bytes are harmless
+	 * as the knote is EV_CLEAR and will be drained next time.
+	 */
+	char c[64];
+	if (read(eventfd->self_pipe_[0], c, sizeof(c)) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK) {
+		return (errno);
+	}
+#endif
+
+	if (kevent(eventfd->kq_, NULL, 0, kevs, nitems(kevs),
+		&(struct timespec){0, 0}) < 0) {
+		return (errno);
 	}
 
 	return (0);
 }
 
+/*
+ * Signals or drains the kqueue after the counter went from zero to non-zero
+ * or back. A concurrent read or write may flip the counter before our
+ * trigger or drain lands and undo theirs, so check the counter afterwards
+ * and repeat with its new state. Whoever acts last sees the final value.
+ */
+static errno_t
+eventfd_ctx_update_readiness(EventFDCtx *eventfd, bool is_readable)
+{
+	errno_t ec = 0;
+
+	for (;;) {
+		if (is_readable) {
+			errno_t ec_local = eventfd_ctx_trigger(eventfd);
+			ec = ec != 0 ? ec : ec_local;
+			eventfd_ctx_signal_watch(eventfd);
+		} else {
+			eventfd_ctx_unsignal_watch(eventfd);
+			(void)eventfd_ctx_drain(eventfd);
+		}
+
+		bool is_now_readable = atomic_load(&eventfd->counter_) != 0;
+		if (is_now_readable == is_readable) {
+			return ec;
+		}
+		is_readable = is_now_readable;
+	}
+}
+
 errno_t
 eventfd_ctx_write(EventFDCtx *eventfd, uint64_t value)
 {
-	errno_t ec;
+	if (value == UINT64_MAX) {
+		return (EINVAL);
+	}
 
-	(void)pthread_mutex_lock(&eventfd->mutex_);
-	ec = eventfd_ctx_write_impl(eventfd, value);
-	(void)pthread_mutex_unlock(&eventfd->mutex_);
+	uint_least64_t current_value = atomic_load_explicit(&eventfd->counter_,
+	    memory_order_relaxed);
+	uint_least64_t new_value;
 
-	return ec;
+	do {
+		if (__builtin_add_overflow(current_value, value, &new_value) ||
+		    new_value > UINT64_MAX - 1) {
+			return (EAGAIN);
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&eventfd->counter_,
+	    &current_value, new_value, /**/
+	    memory_order_release, memory_order_relaxed));
+
+	/* Only the writer that makes the counter non-zero signals. */
+	if (current_value == 0 && new_value != 0) {
+		errno_t ec = eventfd_ctx_update_readiness(eventfd, true);
+
+		/*
+		 * The sequence must be bumped unconditionally. Otherwise a
+		 * reader that registers as waiter right after the check below
+		 * could sleep forever.
+		 */
+		atomic_fetch_add(&eventfd->wake_seq_, 1);
+#ifdef EPOLL_SHIM_HAVE_FUTEX
+		if (atomic_load(&eventfd->nr_waiters_) != 0) {
+			futex_wake_all(&eventfd->wake_seq_);
+		}
+#endif
+
+		return ec;
+	}
+
+	return (0);
 }
 
-static errno_t
-eventfd_ctx_read_impl(EventFDCtx *eventfd, uint64_t *value)
+errno_t
+eventfd_ctx_read(EventFDCtx *eventfd, uint64_t *value)
 {
-	uint_least64_t current_value;
+	uint_least64_t current_value = atomic_load_explicit(&eventfd->counter_,
+	    memory_order_relaxed);
+	uint_least64_t new_value;
+
+	do {
+		if (current_value == 0) {
+			return (EAGAIN);
+		}
+
+		new_value = (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE)
+		    ? current_value - 1
+		    : 0;
+	} while (!atomic_compare_exchange_weak_explicit(&eventfd->counter_,
+	    &current_value, new_value, /**/
+	    memory_order_acquire, memory_order_relaxed));
 
-	current_value = eventfd->counter_;
-	if (current_value == 0) {
-		return (EAGAIN);
+	if (new_value == 0) {
+		(void)eventfd_ctx_update_readiness(eventfd, false);
 	}
 
-	uint_least64_t new_value =
-	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? current_value - 1
-							   : 0;
+	*value =
+	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? 1 : current_value;
+	return (0);
+}
+
+errno_t
+eventfd_ctx_read_blocking(EventFDCtx *eventfd, uint64_t *value)
+{
+	for (;;) {
+		unsigned int wake_seq = atomic_load(&eventfd->wake_seq_);
 
-	if (new_value == 0 && eventfd->is_signalled_) {
-		struct kevent kevs[32];
-		int n;
+		errno_t ec = eventfd_ctx_read(eventfd, value);
+		if (ec != EAGAIN) {
+			return (ec);
+		}
 
-#ifndef EVFILT_USER
-		char c[32];
-		while (read(eventfd->self_pipe_[0], c, sizeof(c)) >= 0) {
+#ifdef EPOLL_SHIM_HAVE_FUTEX
+		/*
+		 * Park directly on the counter's wake sequence. This avoids
+		 * a round trip through the kqueue for thread to thread
+		 * wakeups.
+		 */
+		atomic_fetch_add(&eventfd->nr_waiters_, 1);
+		ec = futex_wait(&eventfd->wake_seq_, wake_seq);
+		atomic_fetch_sub(&eventfd->nr_waiters_, 1);
+		if (ec != 0) {
+			return (ec);
 		}
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+#else
+		(void)wake_seq;
+
+		struct pollfd pfd = {.fd = eventfd->kq_, .events = POLLIN};
+		if (poll(&pfd, 1, -1) < 0) {
 			return (errno);
 		}
 #endif
+	}
+}
 
-		while ((n = kevent(eventfd->kq_, NULL, 0, kevs, nitems(kevs),
-			    &(struct timespec){0, 0})) > 0) {
-		}
-		if (n < 0) {
-			return (errno);
+EventFDWatch *
+eventfd_ctx_watch_acquire(EventFDCtx *eventfd, errno_t *ec)
+{
+#ifdef EVFILT_USER
+	EventFDWatch *watch = atomic_load(&eventfd->watch_);
+
+	if (!watch) {
+		EventFDWatch *new_watch = malloc(sizeof(EventFDWatch));
+		if (!new_watch) {
+			*ec = errno;
+			return NULL;
 		}
 
-		eventfd->is_signalled_ = false;
+		/* One reference is owned by the eventfd. */
+		atomic_init(&new_watch->refcount, 1);
+		atomic_init(&new_watch->kq, -1);
+		atomic_init(&new_watch->nr_kq_users, 0);
+		atomic_init(&new_watch->is_readable, false);
+
+		if (atomic_compare_exchange_strong(&eventfd->watch_, &watch,
+			new_watch)) {
+			watch = new_watch;
+			atomic_store(&watch->is_readable,
+			    atomic_load(&eventfd->counter_) != 0);
+		} else {
+			free(new_watch);
+		}
 	}
 
-	eventfd->counter_ = new_value;
+	atomic_fetch_add(&watch->refcount, 1);
+	return watch;
+#else
+	(void)eventfd;
 
-	*value =
-	    (eventfd->flags_ & EVENTFD_CTX_FLAG_SEMAPHORE) ? 1 : current_value;
-	return (0);
+	*ec = ENOTSUP;
+	return NULL;
+#endif
 }
 
-errno_t
-eventfd_ctx_read(EventFDCtx *eventfd, uint64_t *value)
+bool
+eventfd_watch_attach(EventFDWatch *watch, int kq)
 {
-	errno_t ec;
+	int expected = -1;
+	return atomic_compare_exchange_strong(&watch->kq, &expected, kq);
+}
 
-	(void)pthread_mutex_lock(&eventfd->mutex_);
-	ec = eventfd_ctx_read_impl(eventfd, value);
-	(void)pthread_mutex_unlock(&eventfd->mutex_);
+void
+eventfd_watch_detach(EventFDWatch *watch, int kq)
+{
+	(void)atomic_compare_exchange_strong(&watch->kq, &kq, -1);
+
+	/*
+	 * Users that loaded the kq before it was cleared have announced
+	 * themselves already. They only make a single kevent call.
+	 */
+	while (atomic_load(&watch->nr_kq_users) != 0) {
+		(void)sched_yield();
+	}
+}
 
-	return ec;
+void
+eventfd_watch_release(EventFDWatch *watch)
+{
+	if (atomic_fetch_sub(&watch->refcount, 1) == 1) {
+		free(watch);
+	}
 }
@@ -1,29 +1,69 @@
 #ifndef EVENTFD_CTX_H_
 #define EVENTFD_CTX_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-#include <pthread.h>
-
 #define EVENTFD_CTX_FLAG_SEMAPHORE (1 << 0)
 
+/*
+ * Link between an eventfd and the epoll instance it is flattened into. The
+ * epoll instance registers an EVFILT_USER knote on its own kqueue, using the
+ * address of the watch as ident, and the eventfd triggers that knote
+ * directly. The watch is reference counted as the epoll instance may
+ * outlive the eventfd and vice versa. At most one epoll instance can be
+ * attached at any time. While 'nr_kq_users' is non-zero, the attached kq
+ * may be in use and must not be closed.
+ */
+typedef struct {
+	atomic_uint refcount;
+	atomic_int kq;
+	atomic_uint nr_kq_users;
+	atomic_bool is_readable;
+} EventFDWatch;
+
+/*
+ * The counter is managed with atomic operations only. The eventfd's kqueue
+ * is signalled whenever the counter goes from zero to non-zero, and drained
+ * when a read brings it back to zero.
+ */
 typedef struct {
 	int kq_; // non owning
 	int flags_;
-	pthread_mutex_t mutex_;
 
-	bool is_signalled_;
 	int self_pipe_[2]; // only used if EVFILT_USER is not available
-	uint_least64_t counter_;
+	atomic_uint_least64_t counter_;
+
+	/* Blocking readers wait on 'wake_seq_' instead of the kqueue. */
+	atomic_uint wake_seq_;
+	atomic_uint nr_waiters_;
+
+	_Atomic(EventFDWatch *) watch_;
 } EventFDCtx;
 
 errno_t eventfd_ctx_init(EventFDCtx *eventfd, int kq, unsigned int counter,
     int flags);
 errno_t eventfd_ctx_terminate(EventFDCtx *eventfd);
 
+/*
+ * Lock-free and async-signal-safe: Only atomic operations and a kevent(2) or
+ * write(2) system call (plus a kevent(2) for an attached epoll instance) are
+ * used.
+ */
 errno_t eventfd_ctx_write(EventFDCtx *eventfd, uint64_t value);
 errno_t eventfd_ctx_read(EventFDCtx *eventfd, uint64_t *value);
+errno_t eventfd_ctx_read_blocking(EventFDCtx *eventfd, uint64_t *value);
+
+/*
+ * Returns a new reference to the eventfd's watch, creating it if needed.
+ * Fails with ENOTSUP if EVFILT_USER is not available.
+ */
+EventFDWatch *eventfd_ctx_watch_acquire(EventFDCtx *eventfd, errno_t *ec);
+bool eventfd_watch_attach(EventFDWatch *watch, int kq);
+/* Waits until the eventfd no longer uses 'kq', so it may be closed. */
+void eventfd_watch_detach(EventFDWatch *watch, int kq);
+void eventfd_watch_release(EventFDWatch *watch);
 
 #endif
@@ -0,0 +1,67 @@
+#include "futex.h"
+
+#ifdef EPOLL_SHIM_HAVE_FUTEX
+
+#include <sys/types.h>
+
+#if defined(__FreeBSD__)
+#include <sys/umtx.h>
+#elif defined(__OpenBSD__)
+#include <sys/futex.h>
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+errno_t
+futex_wait(atomic_uint *addr, unsigned int expected)
+{
+	int ret;
+
+#if defined(__FreeBSD__)
+	ret = _umtx_op(addr, UMTX_OP_WAIT_UINT_PRIVATE, expected, NULL, NULL);
+#elif defined(__OpenBSD__)
+	ret = futex((volatile uint32_t *)addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+	    (int)expected, NULL, NULL);
+#elif defined(__DragonFly__)
+	ret = umtx_sleep((volatile int const *)addr, (int)expected, 0);
+#elif defined(__linux__)
+	ret = (int)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL,
+	    NULL, 0);
+#endif
+
+	if (ret < 0) {
+		/* A changed value or a timeout is not an error here. */
+		if (errno == EINTR) {
+			return EINTR;
+		}
+	}
+
+	return 0;
+}
+
+void
+futex_wake_all(atomic_uint *addr)
+{
+	int const saved_errno = errno;
+
+#if defined(__FreeBSD__)
+	(void)_umtx_op(addr, UMTX_OP_WAKE_PRIVATE, INT_MAX, NULL, NULL);
+#elif defined(__OpenBSD__)
+	(void)futex((volatile uint32_t *)addr,
+	    FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL);
+#elif defined(__DragonFly__)
+	(void)umtx_wakeup((volatile int const *)addr, 0);
+#elif defined(__linux__)
+	(void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL,
+	    0);
+#endif
+
+	errno = saved_errno;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * Minimal address-wait primitive for in-process blocking. Only available on
+ * systems that have a futex-like system call.
+ */
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || \
+    defined(__linux__)
+#define EPOLL_SHIM_HAVE_FUTEX
+#endif
+
+#ifdef EPOLL_SHIM_HAVE_FUTEX
+/*
+ * Blocks while '*addr' equals 'expected'. May return spuriously. Returns
+ * EINTR if interrupted by a signal.
+ */
+errno_t futex_wait(atomic_uint *addr, unsigned int expected);
+/* Async-signal-safe. */
+void futex_wake_all(atomic_uint *addr);
+#endif
+
+#endif
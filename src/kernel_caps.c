@@ -0,0 +1,163 @@
+#include "kernel_caps.h"
+
+#include <sys/types.h>
+
+#include <sys/event.h>
+#include <sys/socket.h>
+#if defined(__NetBSD__)
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Until probed, trust the headers. */
+KernelCaps kernel_caps = {
+#ifdef EVFILT_USER
+    .has_evfilt_user = true,
+#endif
+#ifdef EVFILT_EXCEPT
+    .has_evfilt_except = true,
+#endif
+#ifdef NOTE_USECONDS
+    .has_note_useconds = true,
+    .has_zero_timer = true,
+#endif
+#if defined(__NetBSD__) &&                                                    \
+    (!defined(__NetBSD_Version__) || __NetBSD_Version__ <= 910000000)
+    .has_quirky_evfilt_timer = true,
+#endif
+#if defined(__NetBSD__)
+    .fifo_no_reader_error = EBADF,
+#else
+    .fifo_no_reader_error = EPIPE,
+#endif
+};
+
+static pthread_once_t kernel_caps_once = PTHREAD_ONCE_INIT;
+
+/* The FIFO error observed on the running kernel, or 0 until then. */
+static atomic_int fifo_no_reader_error_probed;
+
+/* Returns the error of adding 'kev' to 'kq', or -1 if that is unknown. */
+static int
+kernel_caps_try_kevent(int kq, struct kevent *kev)
+{
+	kev->flags |= EV_RECEIPT;
+
+	int n = kevent(kq, kev, 1, kev, 1, NULL);
+	if (n < 0) {
+		return errno;
+	}
+	if (n != 1 || !(kev->flags & EV_ERROR)) {
+		return -1;
+	}
+
+	return (int)kev->data;
+}
+
+static void
+kernel_caps_probe_timers(int kq)
+{
+	struct kevent kev[1];
+
+#ifdef NOTE_USECONDS
+	EV_SET(&kev[0], 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, /**/
+	    NOTE_USECONDS, 1000000000, 0);
+	kernel_caps.has_note_useconds = kernel_caps_try_kevent(kq, kev) == 0;
+#endif
+
+	EV_SET(&kev[0], 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 0, 0);
+	int ec = kernel_caps_try_kevent(kq, kev);
+	if (ec >= 0) {
+		kernel_caps.has_zero_timer = ec == 0;
+	}
+
+#if defined(__NetBSD__)
+	/* Early expirations cannot be provoked reliably, so go by the
+	 * release the fix went into. */
+	int osrevision;
+	size_t len = sizeof(osrevision);
+	if (sysctlbyname("kern.osrevision", &osrevision, &len, NULL, 0) == 0) {
+		kernel_caps.has_quirky_evfilt_timer = osrevision <= 910000000;
+	}
+#endif
+}
+
+static void
+kernel_caps_probe_impl(void)
+{
+	int kq = kqueue();
+	if (kq < 0) {
+		return;
+	}
+
+	struct kevent kev[1];
+
+#ifdef EVFILT_USER
+	EV_SET(&kev[0], 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+	kernel_caps.has_evfilt_user = kernel_caps_try_kevent(kq, kev) == 0;
+#endif
+
+#ifdef EVFILT_EXCEPT
+	int sv[2];
+	if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0) {
+		EV_SET(&kev[0], sv[0], EVFILT_EXCEPT, EV_ADD, NOTE_OOB, 0, 0);
+		kernel_caps.has_evfilt_except =
+		    kernel_caps_try_kevent(kq, kev) == 0;
+		(void)close(sv[0]);
+		(void)close(sv[1]);
+	}
+#else
+	(void)kev;
+#endif
+
+	kernel_caps_probe_timers(kq);
+
+	(void)close(kq);
+}
+
+void
+kernel_caps_probe(void)
+{
+	(void)pthread_once(&kernel_caps_once, kernel_caps_probe_impl);
+}
+
+int
+kernel_caps_fifo_no_reader_error(void)
+{
+	int ec = atomic_load_explicit(&fifo_no_reader_error_probed,
+	    memory_order_relaxed);
+	return ec != 0 ? ec : kernel_caps.fifo_no_reader_error;
+}
+
+bool
+kernel_caps_is_fifo_no_reader_error(int fd, int ec)
+{
+	if (ec == EPIPE) {
+		return true;
+	}
+
+	/*
+	 * No FIFO is created just for probing. Instead, the first failure on
+	 * a FIFO of the caller settles the error if poll confirms that the
+	 * reader is gone.
+	 */
+	if (atomic_load_explicit(&fifo_no_reader_error_probed,
+		memory_order_relaxed) == 0) {
+		struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+		if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP)) {
+			atomic_store_explicit(&fifo_no_reader_error_probed, ec,
+			    memory_order_relaxed);
+		}
+	}
+
+	return ec == kernel_caps_fifo_no_reader_error();
+}
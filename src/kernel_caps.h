@@ -0,0 +1,43 @@
+#ifndef KERNEL_CAPS_H_
+#define KERNEL_CAPS_H_
+
+#include <stdbool.h>
+
+/*
+ * Behavior of the running kernel, as opposed to what the headers the shim
+ * was built with promise. Filled in by 'kernel_caps_probe'.
+ */
+typedef struct {
+	bool has_evfilt_user;
+	bool has_evfilt_except;
+	bool has_note_useconds;
+	/* EVFILT_TIMER accepts a timeout of zero. */
+	bool has_zero_timer;
+	/* EVFILT_TIMER may fire up to one tick early. */
+	bool has_quirky_evfilt_timer;
+	/* Error of adding EVFILT_WRITE on a FIFO without reader, as far as
+	 * the headers tell. See 'kernel_caps_fifo_no_reader_error'. */
+	int fifo_no_reader_error;
+} KernelCaps;
+
+extern KernelCaps kernel_caps;
+
+/*
+ * Probes the kernel once. Must be called before 'kernel_caps' is read. All
+ * shim objects are created through 'epoll_shim_ctx_create_node', which does
+ * that.
+ */
+void kernel_caps_probe(void);
+
+/*
+ * The FIFO error is probed lazily, on the first FIFO of the caller whose
+ * EVFILT_WRITE registration fails for lack of a reader. Until then, the
+ * default from the headers is returned.
+ */
+int kernel_caps_fifo_no_reader_error(void);
+
+/* Tells if 'ec' from adding EVFILT_WRITE on the FIFO 'fd' means that it has
+ * no reader. */
+bool kernel_caps_is_fifo_no_reader_error(int fd, int ec);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef SHIM_MUTEX_H_
+#define SHIM_MUTEX_H_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+/*
+ * A mutex that can be switched off for objects only ever used by a single
+ * thread. In the single threaded library variant (built with
+ * EPOLL_SHIM_SINGLE_THREADED), all of them are. Debug builds assert that no
+ * two threads enter a switched off mutex at the same time.
+ */
+typedef struct {
+#ifndef EPOLL_SHIM_SINGLE_THREADED
+	pthread_mutex_t mutex;
+#endif
+	bool is_disabled;
+#ifndef NDEBUG
+	atomic_bool is_held;
+#endif
+} ShimMutex;
+
+#ifdef EPOLL_SHIM_SINGLE_THREADED
+#define SHIM_MUTEX_INITIALIZER                                                \
+	{                                                                     \
+		.is_disabled = true                                           \
+	}
+#else
+#define SHIM_MUTEX_INITIALIZER                                                \
+	{                                                                     \
+		.mutex = PTHREAD_MUTEX_INITIALIZER                            \
+	}
+#endif
+
+static inline errno_t
+shim_mutex_init(ShimMutex *mutex, bool is_disabled)
+{
+#ifndef NDEBUG
+	atomic_init(&mutex->is_held, false);
+#endif
+
+#ifdef EPOLL_SHIM_SINGLE_THREADED
+	(void)is_disabled;
+	mutex->is_disabled = true;
+	return 0;
+#else
+	mutex->is_disabled = is_disabled;
+	return is_disabled ? 0 : pthread_mutex_init(&mutex->mutex, NULL);
+#endif
+}
+
+static inline errno_t
+shim_mutex_destroy(ShimMutex *mutex)
+{
+#ifndef EPOLL_SHIM_SINGLE_THREADED
+	if (!mutex->is_disabled) {
+		return pthread_mutex_destroy(&mutex->mutex);
+	}
+#endif
+
+	assert(!atomic_load(&mutex->is_held));
+	return 0;
+}
+
+static inline void
+shim_mutex_lock(ShimMutex *mutex)
+{
+#ifndef EPOLL_SHIM_SINGLE_THREADED
+	if (!mutex->is_disabled) {
+		(void)pthread_mutex_lock(&mutex->mutex);
+		return;
+	}
+#endif
+
+#ifndef NDEBUG
+	/* Another thread is using the object at the same time. */
+	bool was_held = atomic_exchange(&mutex->is_held, true);
+	assert(!was_held);
+	(void)was_held;
+#endif
+}
+
+static inline void
+shim_mutex_unlock(ShimMutex *mutex)
+{
+#ifndef EPOLL_SHIM_SINGLE_THREADED
+	if (!mutex->is_disabled) {
+		(void)pthread_mutex_unlock(&mutex->mutex);
+		return;
+	}
+#endif
+
+#ifndef NDEBUG
+	atomic_store(&mutex->is_held, false);
+#endif
+}
+
+#endif
@@ -61,10 +61,17 @@ timerfd_close(FDContextMapNode *node)
 	return timerfd_ctx_terminate(&node->ctx.timerfd);
 }
 
+static errno_t
+timerfd_consume(FDContextMapNode *node, uint64_t *value)
+{
+	return timerfd_ctx_read(&node->ctx.timerfd, value);
+}
+
 static FDContextVTable const timerfd_vtable = {
     .read_fun = timerfd_read,
     .write_fun = fd_context_default_write,
     .close_fun = timerfd_close,
+    .consume_fun = timerfd_consume,
 };
 
 static FDContextMapNode *
@@ -77,7 +84,8 @@ timerfd_create_impl(int clockid, int flags, errno_t *ec)
 		return NULL;
 	}
 
-	if (flags & ~(TFD_CLOEXEC | TFD_NONBLOCK)) {
+	if (flags &
+	    ~(TFD_CLOEXEC | TFD_NONBLOCK | TFD_PRECISE | TFD_SINGLE_THREADED)) {
 		*ec = EINVAL;
 		return NULL;
 	}
@@ -89,8 +97,16 @@ timerfd_create_impl(int clockid, int flags, errno_t *ec)
 
 	node->flags = flags;
 
+	int ctx_flags = 0;
+	if (flags & TFD_PRECISE) {
+		ctx_flags |= TIMERFD_CTX_FLAG_PRECISE;
+	}
+	if (flags & TFD_SINGLE_THREADED) {
+		ctx_flags |= TIMERFD_CTX_FLAG_SINGLE_THREADED;
+	}
+
 	if ((*ec = timerfd_ctx_init(&node->ctx.timerfd, /**/
-		 node->fd, clockid)) != 0) {
+		 node->fd, clockid, ctx_flags)) != 0) {
 		goto fail;
 	}
 
@@ -119,8 +135,8 @@ timerfd_create(int clockid, int flags)
 }
 
 static errno_t
-timerfd_settime_impl(int fd, int flags, const struct itimerspec *new,
-    struct itimerspec *old)
+timerfd_settime_impl(int fd, struct epoll_shim_handle *handle, int flags,
+    const struct itimerspec *new, struct itimerspec *old)
 {
 	errno_t ec;
 	FDContextMapNode *node;
@@ -133,10 +149,17 @@ timerfd_settime_impl(int fd, int flags, const struct itimerspec *new,
 		return EINVAL;
 	}
 
-	node = epoll_shim_ctx_find_node(&epoll_shim_ctx, fd);
-	if (!node || node->vtable != &timerfd_vtable) {
-		struct stat sb;
-		return (fd < 0 || fstat(fd, &sb)) ? EBADF : EINVAL;
+	if (handle) {
+		node = (FDContextMapNode *)handle;
+		if (node->vtable != &timerfd_vtable) {
+			return EINVAL;
+		}
+	} else {
+		node = epoll_shim_ctx_find_node(&epoll_shim_ctx, fd);
+		if (!node || node->vtable != &timerfd_vtable) {
+			struct stat sb;
+			return (fd < 0 || fstat(fd, &sb)) ? EBADF : EINVAL;
+		}
 	}
 
 	if ((ec = timerfd_ctx_settime(&node->ctx.timerfd,
@@ -152,7 +175,7 @@ int
 timerfd_settime(int fd, int flags, const struct itimerspec *new,
     struct itimerspec *old)
 {
-	errno_t ec = timerfd_settime_impl(fd, flags, new, old);
+	errno_t ec = timerfd_settime_impl(fd, NULL, flags, new, old);
 	if (ec != 0) {
 		errno = ec;
 		return -1;
@@ -161,6 +184,106 @@ timerfd_settime(int fd, int flags, const struct itimerspec *new,
 	return 0;
 }
 
+int
+timerfd_settime_h(struct epoll_shim_handle *handle, int flags,
+    const struct itimerspec *new, struct itimerspec *old)
+{
+	errno_t ec = timerfd_settime_impl(-1, handle, flags, new, old);
+	if (ec != 0) {
+		errno = ec;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Timers are looked up in chunks of this size. */
+#define TIMERFD_SETTIME_CHUNK 64
+
+static errno_t
+timerfd_settime_many_entry(struct timerfd_settime_entry const *entry,
+    FDContextMapNode *node, struct timespec current_times[2],
+    bool have_current_times[2])
+{
+	if (entry->flags & ~(TFD_TIMER_ABSTIME)) {
+		return EINVAL;
+	}
+
+	if (!node || node->vtable != &timerfd_vtable) {
+		struct stat sb;
+		return (entry->fd < 0 || fstat(entry->fd, &sb)) ? EBADF
+								: EINVAL;
+	}
+
+	TimerFDCtx *timerfd = &node->ctx.timerfd;
+
+	/* Sample each clock only once per batch. */
+	int i = timerfd->clockid == CLOCK_MONOTONIC ? 0 : 1;
+	if (!have_current_times[i]) {
+		if (clock_gettime(timerfd->clockid, &current_times[i]) < 0) {
+			return errno;
+		}
+		have_current_times[i] = true;
+	}
+
+	return timerfd_ctx_settime_at(timerfd,
+	    (entry->flags & TFD_TIMER_ABSTIME) ? TIMER_ABSTIME : 0, /**/
+	    &entry->v, NULL, &current_times[i]);
+}
+
+int
+timerfd_settime_many(struct timerfd_settime_entry const *entries, size_t n,
+    int *errs)
+{
+	if (!entries && n > 0) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	struct timespec current_times[2];
+	bool have_current_times[2] = {false, false};
+	errno_t first_ec = 0;
+
+	for (size_t base = 0; base < n; base += TIMERFD_SETTIME_CHUNK) {
+		size_t chunk_n = n - base < TIMERFD_SETTIME_CHUNK
+		    ? n - base
+		    : TIMERFD_SETTIME_CHUNK;
+
+		/* The references keep the timers alive against a close. */
+		int fds[TIMERFD_SETTIME_CHUNK];
+		FDContextMapNode *nodes[TIMERFD_SETTIME_CHUNK];
+
+		for (size_t i = 0; i < chunk_n; ++i) {
+			fds[i] = entries[base + i].fd;
+		}
+		epoll_shim_ctx_ref_nodes(&epoll_shim_ctx, fds, chunk_n, nodes);
+
+		for (size_t i = 0; i < chunk_n; ++i) {
+			errno_t ec = timerfd_settime_many_entry(
+			    &entries[base + i], nodes[i], current_times,
+			    have_current_times);
+
+			if (nodes[i]) {
+				(void)fd_context_map_node_unref(nodes[i]);
+			}
+
+			if (errs) {
+				errs[base + i] = ec;
+			}
+			if (ec != 0 && first_ec == 0) {
+				first_ec = ec;
+			}
+		}
+	}
+
+	if (first_ec != 0) {
+		errno = first_ec;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 timerfd_gettime_impl(int fd, struct itimerspec *cur)
 {
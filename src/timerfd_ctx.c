@@ -10,6 +10,8 @@
 #include <errno.h>
 #include <signal.h>
 
+#include "kernel_caps.h"
+
 #ifndef nitems
 #define nitems(x) (sizeof((x)) / sizeof((x)[0]))
 #endif
@@ -91,26 +93,34 @@ timespecsub_safe(struct timespec const *tsp, struct timespec const *usp,
 }
 
 static bool
-timerfd_ctx_is_disarmed(TimerFDCtx const *timerfd)
+itimerspec_is_disarmed(struct itimerspec const *its)
 {
-	return /**/
-	    timerfd->current_itimerspec.it_value.tv_sec == 0 &&
-	    timerfd->current_itimerspec.it_value.tv_nsec == 0;
+	return its->it_value.tv_sec == 0 && its->it_value.tv_nsec == 0;
 }
 
 static bool
-timerfd_ctx_is_interval_timer(TimerFDCtx const *timerfd)
+itimerspec_is_interval_timer(struct itimerspec const *its)
+{
+	return its->it_interval.tv_sec != 0 || its->it_interval.tv_nsec != 0;
+}
+
+static void
+itimerspec_disarm(struct itimerspec *its)
+{
+	its->it_value.tv_sec = 0;
+	its->it_value.tv_nsec = 0;
+}
+
+static bool
+timerfd_ctx_is_disarmed(TimerFDCtx const *timerfd)
 {
-	return /**/
-	    timerfd->current_itimerspec.it_interval.tv_sec != 0 ||
-	    timerfd->current_itimerspec.it_interval.tv_nsec != 0;
+	return itimerspec_is_disarmed(&timerfd->current_itimerspec);
 }
 
 static void
 timerfd_ctx_disarm(TimerFDCtx *timerfd)
 {
-	timerfd->current_itimerspec.it_value.tv_sec = 0;
-	timerfd->current_itimerspec.it_value.tv_nsec = 0;
+	itimerspec_disarm(&timerfd->current_itimerspec);
 }
 
 static errno_t
@@ -136,19 +146,25 @@ nanos_to_ts(int64_t ts_nanos)
 	};
 }
 
-static void
-timerfd_ctx_update_to_current_time(TimerFDCtx *timerfd,
+/*
+ * Moves the absolute expiration time of 'its' past 'current_time' and returns
+ * the number of expirations that happened in between. This is a pure function
+ * so that it can also be used on snapshots of the timer state.
+ */
+static uint64_t
+itimerspec_advance_to_current_time(struct itimerspec *its,
     struct timespec const *current_time)
 {
-	if (timerfd_ctx_is_disarmed(timerfd)) {
-		return;
+	uint64_t nr_expirations = 0;
+
+	if (itimerspec_is_disarmed(its)) {
+		return 0;
 	}
 
-	if (timerfd_ctx_is_interval_timer(timerfd)) {
+	if (itimerspec_is_interval_timer(its)) {
 		struct timespec diff_time;
 
-		if (timespecsub_safe(current_time,
-			&timerfd->current_itimerspec.it_value,
+		if (timespecsub_safe(current_time, &its->it_value,
 			&diff_time) != 0) {
 			goto disarm;
 		}
@@ -160,9 +176,7 @@ timerfd_ctx_update_to_current_time(TimerFDCtx *timerfd,
 			}
 
 			int64_t interval_nanos;
-			if (ts_to_nanos(
-				&timerfd->current_itimerspec.it_interval,
-				&interval_nanos)) {
+			if (ts_to_nanos(&its->it_interval, &interval_nanos)) {
 				goto disarm;
 			}
 
@@ -179,38 +193,99 @@ timerfd_ctx_update_to_current_time(TimerFDCtx *timerfd,
 			}
 
 			struct timespec next_ts = nanos_to_ts(nanos_to_add);
-			if (timespecadd_safe(&next_ts,
-				&timerfd->current_itimerspec.it_value,
+			if (timespecadd_safe(&next_ts, &its->it_value,
 				&next_ts) != 0) {
 				goto disarm;
 			}
 
 			assert(expirations >= 0);
 
-			timerfd->nr_expirations += (uint64_t)expirations;
-			timerfd->current_itimerspec.it_value = next_ts;
+			nr_expirations = (uint64_t)expirations;
+			its->it_value = next_ts;
 		}
 	} else {
-		if (timespeccmp(current_time,
-			&timerfd->current_itimerspec.it_value, >=)) {
-			++timerfd->nr_expirations;
+		if (timespeccmp(current_time, &its->it_value, >=)) {
+			nr_expirations = 1;
 			goto disarm;
 		}
 	}
 
-	assert(timespeccmp(current_time, /**/
-	    &timerfd->current_itimerspec.it_value, <));
+	assert(timespeccmp(current_time, &its->it_value, <));
 
-	return;
+	return nr_expirations;
 
 disarm:
-	timerfd_ctx_disarm(timerfd);
+	itimerspec_disarm(its);
+	return nr_expirations;
 }
 
-#if defined(__NetBSD__) &&                                                    \
-    (!defined(__NetBSD_Version__) || __NetBSD_Version__ <= 910000000)
+static void
+timerfd_ctx_update_to_current_time(TimerFDCtx *timerfd,
+    struct timespec const *current_time)
+{
+	timerfd->nr_expirations += itimerspec_advance_to_current_time(
+	    &timerfd->current_itimerspec, current_time);
+}
 
-/* On NetBSD, EVFILT_TIMER sometimes returns early. */
+/*
+ * Readers of the snapshot never take the mutex. Writers must hold it, so
+ * there is at most one writer at any time.
+ */
+static void
+timerfd_ctx_publish(TimerFDCtx *timerfd)
+{
+	unsigned int seq = atomic_load_explicit(&timerfd->snapshot_seq,
+	    memory_order_relaxed);
+
+	atomic_store_explicit(&timerfd->snapshot_seq, seq + 1,
+	    memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	struct itimerspec const *its = &timerfd->current_itimerspec;
+	atomic_store_explicit(&timerfd->snapshot.value_sec,
+	    its->it_value.tv_sec, memory_order_relaxed);
+	atomic_store_explicit(&timerfd->snapshot.value_nsec,
+	    its->it_value.tv_nsec, memory_order_relaxed);
+	atomic_store_explicit(&timerfd->snapshot.interval_sec,
+	    its->it_interval.tv_sec, memory_order_relaxed);
+	atomic_store_explicit(&timerfd->snapshot.interval_nsec,
+	    its->it_interval.tv_nsec, memory_order_relaxed);
+
+	atomic_store_explicit(&timerfd->snapshot_seq, seq + 2,
+	    memory_order_release);
+}
+
+static void
+timerfd_ctx_load_snapshot(TimerFDCtx *timerfd, struct itimerspec *its)
+{
+	for (;;) {
+		unsigned int seq = atomic_load_explicit(&timerfd->snapshot_seq,
+		    memory_order_acquire);
+		if (seq & 1) {
+			continue;
+		}
+
+		its->it_value.tv_sec = (time_t)atomic_load_explicit(
+		    &timerfd->snapshot.value_sec, memory_order_relaxed);
+		its->it_value.tv_nsec = (long)atomic_load_explicit(
+		    &timerfd->snapshot.value_nsec, memory_order_relaxed);
+		its->it_interval.tv_sec = (time_t)atomic_load_explicit(
+		    &timerfd->snapshot.interval_sec, memory_order_relaxed);
+		its->it_interval.tv_nsec = (long)atomic_load_explicit(
+		    &timerfd->snapshot.interval_nsec, memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&timerfd->snapshot_seq,
+			memory_order_relaxed) == seq) {
+			return;
+		}
+	}
+}
+
+#if defined(__NetBSD__)
+
+/* On NetBSD up to 9.1, EVFILT_TIMER sometimes returns early. Whether the
+ * running kernel does is in 'kernel_caps.has_quirky_evfilt_timer'. */
 #define QUIRKY_EVFILT_TIMER
 
 static bool
@@ -245,6 +320,51 @@ round_up_millis(int64_t millis, int64_t *result)
 }
 #endif
 
+/*
+ * In precise mode the kernel timer is armed with a timeout that is rounded
+ * down instead of up, so it may fire slightly before the deadline. The
+ * remaining gap is bridged by spinning on clock_gettime(), but never for
+ * longer than this.
+ */
+static int64_t
+precise_spin_limit_nanos(void)
+{
+	int64_t limit = 1000000;
+
+	/* EVFILT_TIMER may also return up to one tick early. */
+	long ticks = CLK_TCK;
+	if (kernel_caps.has_quirky_evfilt_timer && ticks > 0) {
+		limit += 1000000000 / ticks + !!(1000000000 % ticks);
+	}
+
+	return limit;
+}
+
+static bool
+timerfd_ctx_is_final_approach(TimerFDCtx *timerfd,
+    struct timespec const *current_time)
+{
+	struct timespec remaining;
+	int64_t remaining_nanos;
+
+	return timespecsub_safe(&timerfd->current_itimerspec.it_value,
+		   current_time, &remaining) == 0 &&
+	    ts_to_nanos(&remaining, &remaining_nanos) == 0 &&
+	    remaining_nanos <= precise_spin_limit_nanos();
+}
+
+static void
+spin_until(int clockid, struct timespec const *deadline)
+{
+	struct timespec current_time;
+
+	do {
+		if (clock_gettime(clockid, &current_time) < 0) {
+			return;
+		}
+	} while (timespeccmp(&current_time, deadline, <));
+}
+
 static errno_t
 timerfd_ctx_register_event(TimerFDCtx *timerfd, struct timespec const *new,
     struct timespec const *current_time)
@@ -270,23 +390,30 @@ timerfd_ctx_register_event(TimerFDCtx *timerfd, struct timespec const *new,
 	bool handle_einval_on_zero_value = false;
 
 #ifdef NOTE_USECONDS
-	int64_t micros =
-	    (int64_t)diff_time.tv_sec * 1000000 + diff_time.tv_nsec / 1000;
+	if (kernel_caps.has_note_useconds) {
+		int64_t micros = (int64_t)diff_time.tv_sec * 1000000 +
+		    diff_time.tv_nsec / 1000;
 
-	if ((diff_time.tv_nsec % 1000) != 0) {
-		++micros;
-	}
+		if ((diff_time.tv_nsec % 1000) != 0) {
+			++micros;
+		}
 
-	/* If there is NOTE_USECONDS support we assume timeout values of 0 are
-	 * valid. For FreeBSD this is the case. */
+		if (micros == 0 && !kernel_caps.has_zero_timer) {
+			micros = 1;
+		}
 
-	EV_SET(&kev[0], 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, /**/
-	    NOTE_USECONDS, micros, 0);
-#else
+		EV_SET(&kev[0], 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, /**/
+		    NOTE_USECONDS, micros, 0);
+		goto add_timer;
+	}
+#endif
+
+	bool is_precise = timerfd->flags & TIMERFD_CTX_FLAG_PRECISE;
 
 #ifdef QUIRKY_EVFILT_TIMER
 	/* Let's hope 49 days are enough. */
-	if (diff_time.tv_sec >= 4233600) {
+	if (kernel_caps.has_quirky_evfilt_timer &&
+	    diff_time.tv_sec >= 4233600) {
 		return 0;
 	}
 #endif
@@ -294,31 +421,37 @@ timerfd_ctx_register_event(TimerFDCtx *timerfd, struct timespec const *new,
 	int64_t millis =
 	    (int64_t)diff_time.tv_sec * 1000 + diff_time.tv_nsec / 1000000;
 
-	if ((diff_time.tv_nsec % 1000000) != 0) {
+	/* In precise mode, an early wakeup is corrected when reading. */
+	if (!is_precise && (diff_time.tv_nsec % 1000000) != 0) {
 		++millis;
 	}
 
 #ifdef QUIRKY_EVFILT_TIMER
-	if (!round_up_millis(millis, &millis)) {
+	if (kernel_caps.has_quirky_evfilt_timer && !is_precise &&
+	    !round_up_millis(millis, &millis)) {
 		return 0;
 	}
 #endif
 
 	if (millis == 0) {
-		handle_einval_on_zero_value = true;
+		if (kernel_caps.has_zero_timer) {
+			/* The probe may have been wrong, be prepared. */
+			handle_einval_on_zero_value = true;
+		} else {
+			millis = 1;
+		}
 	}
 
 	EV_SET(&kev[0], 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, /**/
 	    0, millis, 0);
-#endif
 
-retry:
+add_timer:
 	if (kevent(timerfd->kq, kev, nitems(kev), /**/
 		NULL, 0, NULL) < 0) {
 		if (handle_einval_on_zero_value && errno == EINVAL) {
 			kev[0].data = 1;
 			handle_einval_on_zero_value = false;
-			goto retry;
+			goto add_timer;
 		}
 
 		return errno;
@@ -328,15 +461,19 @@ retry:
 }
 
 errno_t
-timerfd_ctx_init(TimerFDCtx *timerfd, int kq, int clockid)
+timerfd_ctx_init(TimerFDCtx *timerfd, int kq, int clockid, int flags)
 {
 	errno_t ec;
 
 	assert(clockid == CLOCK_MONOTONIC || clockid == CLOCK_REALTIME);
+	assert((flags &
+		   ~(TIMERFD_CTX_FLAG_PRECISE |
+		       TIMERFD_CTX_FLAG_SINGLE_THREADED)) == 0);
 
-	*timerfd = (TimerFDCtx){.kq = kq, .clockid = clockid};
+	*timerfd = (TimerFDCtx){.kq = kq, .flags = flags, .clockid = clockid};
 
-	if ((ec = pthread_mutex_init(&timerfd->mutex, NULL)) != 0) {
+	if ((ec = shim_mutex_init(&timerfd->mutex,
+		 (flags & TIMERFD_CTX_FLAG_SINGLE_THREADED) != 0)) != 0) {
 		return ec;
 	}
 
@@ -346,24 +483,24 @@ timerfd_ctx_init(TimerFDCtx *timerfd, int kq, int clockid)
 errno_t
 timerfd_ctx_terminate(TimerFDCtx *timerfd)
 {
-	return pthread_mutex_destroy(&timerfd->mutex);
+	return shim_mutex_destroy(&timerfd->mutex);
 }
 
 static void
-timerfd_ctx_gettime_impl(TimerFDCtx *timerfd, struct itimerspec *cur,
+itimerspec_to_relative(struct itimerspec *its,
     struct timespec const *current_time)
 {
-	timerfd_ctx_update_to_current_time(timerfd, current_time);
-	*cur = timerfd->current_itimerspec;
-	if (!timerfd_ctx_is_disarmed(timerfd)) {
-		assert(timespeccmp(current_time, &cur->it_value, <));
-		timespecsub(&cur->it_value, current_time, &cur->it_value);
+	(void)itimerspec_advance_to_current_time(its, current_time);
+	if (!itimerspec_is_disarmed(its)) {
+		assert(timespeccmp(current_time, &its->it_value, <));
+		timespecsub(&its->it_value, current_time, &its->it_value);
 	}
 }
 
 static errno_t
 timerfd_ctx_settime_impl(TimerFDCtx *timerfd, int flags,
-    struct itimerspec const *new, struct itimerspec *old)
+    struct itimerspec const *new, struct itimerspec *old,
+    struct timespec const *current_time_p)
 {
 	errno_t ec;
 
@@ -374,12 +511,15 @@ timerfd_ctx_settime_impl(TimerFDCtx *timerfd, int flags,
 	assert((flags & ~(TIMER_ABSTIME)) == 0);
 
 	struct timespec current_time;
-	if (clock_gettime(timerfd->clockid, &current_time) < 0) {
+	if (current_time_p) {
+		current_time = *current_time_p;
+	} else if (clock_gettime(timerfd->clockid, &current_time) < 0) {
 		return errno;
 	}
 
 	if (old) {
-		timerfd_ctx_gettime_impl(timerfd, old, &current_time);
+		*old = timerfd->current_itimerspec;
+		itimerspec_to_relative(old, &current_time);
 	}
 
 	if (new->it_value.tv_sec == 0 && new->it_value.tv_nsec == 0) {
@@ -422,12 +562,21 @@ success:
 errno_t
 timerfd_ctx_settime(TimerFDCtx *timerfd, int flags,
     struct itimerspec const *new, struct itimerspec *old)
+{
+	return timerfd_ctx_settime_at(timerfd, flags, new, old, NULL);
+}
+
+errno_t
+timerfd_ctx_settime_at(TimerFDCtx *timerfd, int flags,
+    struct itimerspec const *new, struct itimerspec *old,
+    struct timespec const *current_time)
 {
 	errno_t ec;
 
-	(void)pthread_mutex_lock(&timerfd->mutex);
-	ec = timerfd_ctx_settime_impl(timerfd, flags, new, old);
-	(void)pthread_mutex_unlock(&timerfd->mutex);
+	shim_mutex_lock(&timerfd->mutex);
+	ec = timerfd_ctx_settime_impl(timerfd, flags, new, old, current_time);
+	timerfd_ctx_publish(timerfd);
+	shim_mutex_unlock(&timerfd->mutex);
 
 	return ec;
 }
@@ -440,30 +589,38 @@ timerfd_ctx_gettime(TimerFDCtx *timerfd, struct itimerspec *cur)
 		return errno;
 	}
 
-	(void)pthread_mutex_lock(&timerfd->mutex);
-	timerfd_ctx_gettime_impl(timerfd, cur, &current_time);
-	(void)pthread_mutex_unlock(&timerfd->mutex);
+	timerfd_ctx_load_snapshot(timerfd, cur);
+	itimerspec_to_relative(cur, &current_time);
 
 	return 0;
 }
 
+/*
+ * When a precise timer fired early, EINPROGRESS is returned along with the
+ * deadline to wait for in 'approach_deadline'. The caller spins without the
+ * mutex and calls again with 'has_approached' set. The kevent has already
+ * been retrieved then.
+ */
 static errno_t
-timerfd_ctx_read_impl(TimerFDCtx *timerfd, uint64_t *value)
+timerfd_ctx_read_impl(TimerFDCtx *timerfd, uint64_t *value,
+    bool has_approached, struct timespec *approach_deadline)
 {
 	for (;;) {
-		struct kevent kev;
+		if (!has_approached) {
+			struct kevent kev;
 
-		int n = kevent(timerfd->kq, NULL, 0, &kev, 1,
-		    &(struct timespec){0, 0});
-		if (n < 0) {
-			return errno;
-		}
+			int n = kevent(timerfd->kq, NULL, 0, &kev, 1,
+			    &(struct timespec){0, 0});
+			if (n < 0) {
+				return errno;
+			}
 
-		if (n == 0) {
-			return EAGAIN;
-		}
+			if (n == 0) {
+				return EAGAIN;
+			}
 
-		assert(kev.filter == EVFILT_TIMER);
+			assert(kev.filter == EVFILT_TIMER);
+		}
 
 		struct timespec current_time;
 		if (clock_gettime(timerfd->clockid, &current_time) < 0) {
@@ -472,6 +629,17 @@ timerfd_ctx_read_impl(TimerFDCtx *timerfd, uint64_t *value)
 
 		timerfd_ctx_update_to_current_time(timerfd, &current_time);
 
+		if (!has_approached &&
+		    (timerfd->flags & TIMERFD_CTX_FLAG_PRECISE) &&
+		    !kernel_caps.has_note_useconds &&
+		    timerfd->nr_expirations == 0 &&
+		    !timerfd_ctx_is_disarmed(timerfd) &&
+		    timerfd_ctx_is_final_approach(timerfd, &current_time)) {
+			*approach_deadline =
+			    timerfd->current_itimerspec.it_value;
+			return EINPROGRESS;
+		}
+
 		uint64_t nr_expirations = timerfd->nr_expirations;
 		timerfd->nr_expirations = 0;
 
@@ -496,10 +664,21 @@ errno_t
 timerfd_ctx_read(TimerFDCtx *timerfd, uint64_t *value)
 {
 	errno_t ec;
-
-	(void)pthread_mutex_lock(&timerfd->mutex);
-	ec = timerfd_ctx_read_impl(timerfd, value);
-	(void)pthread_mutex_unlock(&timerfd->mutex);
+	struct timespec approach_deadline;
+
+	shim_mutex_lock(&timerfd->mutex);
+	ec = timerfd_ctx_read_impl(timerfd, value, false, &approach_deadline);
+	if (ec == EINPROGRESS) {
+		/* Do not hold up settime/gettime while spinning. */
+		shim_mutex_unlock(&timerfd->mutex);
+		spin_until(timerfd->clockid, &approach_deadline);
+		shim_mutex_lock(&timerfd->mutex);
+
+		ec = timerfd_ctx_read_impl(timerfd, value, true,
+		    &approach_deadline);
+	}
+	timerfd_ctx_publish(timerfd);
+	shim_mutex_unlock(&timerfd->mutex);
 
 	return ec;
 }
@@ -9,10 +9,15 @@
 #include <pthread.h>
 #include <time.h>
 
+#include "shim_mutex.h"
+
+#define TIMERFD_CTX_FLAG_PRECISE (1 << 0)
+#define TIMERFD_CTX_FLAG_SINGLE_THREADED (1 << 1)
+
 typedef struct {
 	int kq; // non owning
 	int flags;
-	pthread_mutex_t mutex;
+	ShimMutex mutex;
 
 	int clockid;
 	/*
@@ -22,13 +27,35 @@ typedef struct {
 	 */
 	struct itimerspec current_itimerspec;
 	uint64_t nr_expirations;
+
+	/*
+	 * Seqlock protected copy of 'current_itimerspec' so that
+	 * 'timerfd_ctx_gettime' does not need to take the mutex. The state
+	 * itself is only advanced by the owner on settime/read.
+	 */
+	atomic_uint snapshot_seq;
+	struct {
+		atomic_int_least64_t value_sec;
+		atomic_int_least64_t value_nsec;
+		atomic_int_least64_t interval_sec;
+		atomic_int_least64_t interval_nsec;
+	} snapshot;
 } TimerFDCtx;
 
-errno_t timerfd_ctx_init(TimerFDCtx *timerfd, int kq, int clockid);
+errno_t timerfd_ctx_init(TimerFDCtx *timerfd, int kq, int clockid,
+    int flags);
 errno_t timerfd_ctx_terminate(TimerFDCtx *timerfd);
 
 errno_t timerfd_ctx_settime(TimerFDCtx *timerfd, int flags,
     struct itimerspec const *new, struct itimerspec *old);
+/*
+ * Like 'timerfd_ctx_settime', but uses 'current_time' (of the timer's clock)
+ * instead of sampling the clock. Useful when re-arming many timers at once.
+ * If 'current_time' is NULL, the clock is sampled.
+ */
+errno_t timerfd_ctx_settime_at(TimerFDCtx *timerfd, int flags,
+    struct itimerspec const *new, struct itimerspec *old,
+    struct timespec const *current_time);
 errno_t timerfd_ctx_gettime(TimerFDCtx *timerfd, struct itimerspec *cur);
 
 errno_t timerfd_ctx_read(TimerFDCtx *timerfd, uint64_t *value);
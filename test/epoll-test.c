@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -652,6 +653,52 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__poll_only_fd, tc)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__poll_only_fd_many);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__poll_only_fd_many, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[9];
+	for (int i = 0; i < 9; ++i) {
+		fds[i] = open("/dev/random", O_RDONLY | O_CLOEXEC);
+		if (fds[i] < 0) {
+			atf_tc_skip("This test needs /dev/random");
+		}
+
+		struct epoll_event event = {
+		    .events = EPOLLIN,
+		    .data.fd = fds[i],
+		};
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &event) == 0);
+	}
+
+	/* Remove from the front, the middle and the back. */
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[0], NULL) == 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[4], NULL) == 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fds[8], NULL) == 0);
+
+	struct epoll_event events[16];
+	ATF_REQUIRE(epoll_wait(ep, events, 16, -1) == 6);
+
+	bool seen[9] = {false};
+	for (int i = 0; i < 6; ++i) {
+		ATF_REQUIRE(events[i].events == EPOLLIN);
+		for (int j = 0; j < 9; ++j) {
+			if (events[i].data.fd == fds[j]) {
+				ATF_REQUIRE(!seen[j]);
+				seen[j] = true;
+			}
+		}
+	}
+	ATF_REQUIRE(!seen[0] && !seen[4] && !seen[8]);
+
+	for (int i = 0; i < 9; ++i) {
+		ATF_REQUIRE(close(fds[i]) == 0);
+	}
+	ATF_REQUIRE(close(ep) == 0);
+}
+
 static void
 no_epollin_on_closed_empty_pipe_impl(bool do_write_data)
 {
@@ -1566,6 +1613,33 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__remove_closed, tcptr)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__modify_closed);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__modify_closed, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event = {.events = EPOLLIN};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+
+	ATF_REQUIRE_ERRNO(EBADF,
+	    epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) < 0);
+
+	/* The stale registration must be gone. */
+	fd_domain_socket(fds);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
 ATF_TC_WITHOUT_HEAD(epoll__add_different_file_with_same_fd_value);
 ATF_TC_BODY_FD_LEAKCHECK(epoll__add_different_file_with_same_fd_value, tcptr)
 {
@@ -1719,6 +1793,627 @@ ATF_TC_BODY_FD_LEAKCHECK(epoll__epoll_pwait, tcptr)
 	ATF_REQUIRE(close(ep) == 0);
 }
 
+ATF_TC_WITHOUT_HEAD(epoll__eventfd);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__eventfd, tcptr)
+{
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	int ep1 = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep1 >= 0);
+	int ep2 = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep2 >= 0);
+
+	struct epoll_event event = {.events = EPOLLIN, .data.fd = efd};
+	ATF_REQUIRE(epoll_ctl(ep1, EPOLL_CTL_ADD, efd, &event) == 0);
+
+	/* Registering with a second epoll instance must work, too. */
+	event.events = EPOLLIN | EPOLLET;
+	ATF_REQUIRE(epoll_ctl(ep2, EPOLL_CTL_ADD, efd, &event) == 0);
+
+	ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 0);
+	ATF_REQUIRE(epoll_wait(ep2, &event, 1, 0) == 0);
+
+	ATF_REQUIRE(eventfd_write(efd, 1) == 0);
+
+	/* Level triggered: reported until the counter is read. */
+	for (int i = 0; i < 2; ++i) {
+		ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 1);
+		ATF_REQUIRE(event.events == EPOLLIN);
+		ATF_REQUIRE(event.data.fd == efd);
+	}
+
+	/* Edge triggered: reported once. */
+	ATF_REQUIRE(epoll_wait(ep2, &event, 1, 0) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+	ATF_REQUIRE(epoll_wait(ep2, &event, 1, 0) == 0);
+
+	eventfd_t value;
+	ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+	ATF_REQUIRE(value == 1);
+
+	ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 0);
+	ATF_REQUIRE(epoll_wait(ep2, &event, 1, 0) == 0);
+
+	ATF_REQUIRE(eventfd_write(efd, 2) == 0);
+	ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 1);
+	ATF_REQUIRE(epoll_wait(ep2, &event, 1, 0) == 1);
+
+	/* Readiness established before registration is picked up. */
+	ATF_REQUIRE(epoll_ctl(ep1, EPOLL_CTL_DEL, efd, NULL) == 0);
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep1, EPOLL_CTL_ADD, efd, &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+
+	ATF_REQUIRE(close(efd) == 0);
+	ATF_REQUIRE(close(ep1) == 0);
+	ATF_REQUIRE(close(ep2) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__oneshot_rearm);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__oneshot_rearm, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event = {
+	    .events = EPOLLIN | EPOLLONESHOT,
+	    .data.fd = fds[0],
+	};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(write(fds[1], "a", 1) == 1);
+
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+		ATF_REQUIRE(event.events == EPOLLIN);
+		ATF_REQUIRE(event.data.fd == fds[0]);
+
+		/* Disarmed, even though new data arrives. */
+		ATF_REQUIRE(write(fds[1], "b", 1) == 1);
+		ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+		/* Re-arming reports the data that is still pending. */
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.fd = fds[0];
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	}
+
+	/* Re-arming with different events works as well. */
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+	event.events = EPOLLIN | EPOLLOUT | EPOLLONESHOT;
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.events == (EPOLLIN | EPOLLOUT));
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+	/* So does switching between level and edge triggering. */
+	event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.fd = fds[0];
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+typedef struct {
+	int ep;
+	int fd;
+	atomic_bool quit;
+} CtlDuringWaitArgs;
+
+static void *
+ctl_during_wait_thread_fun(void *arg)
+{
+	CtlDuringWaitArgs *args = arg;
+
+	while (!atomic_load(&args->quit)) {
+		struct epoll_event event_results[8];
+		int n = epoll_wait(args->ep, event_results, 8, 1);
+		ATF_REQUIRE(n >= 0);
+
+		for (int i = 0; i < n; ++i) {
+			ATF_REQUIRE(event_results[i].data.fd == args->fd);
+			ATF_REQUIRE(event_results[i].events == EPOLLIN);
+		}
+	}
+
+	return NULL;
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__ctl_during_wait);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__ctl_during_wait, tcptr)
+{
+	CtlDuringWaitArgs args = {.ep = epoll_create1(EPOLL_CLOEXEC)};
+	ATF_REQUIRE(args.ep >= 0);
+	atomic_init(&args.quit, false);
+
+	int fds[3];
+	fd_domain_socket(fds);
+	args.fd = fds[0];
+
+	ATF_REQUIRE(write(fds[1], "a", 1) == 1);
+
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i) {
+		ATF_REQUIRE(pthread_create(&threads[i], NULL,
+				&ctl_during_wait_thread_fun, &args) == 0);
+	}
+
+	/* Registrations come and go while the waiters harvest them. */
+	for (int i = 0; i < 2000; ++i) {
+		struct epoll_event event = {
+		    .events = EPOLLIN,
+		    .data.fd = fds[0],
+		};
+		ATF_REQUIRE(epoll_ctl(args.ep, EPOLL_CTL_ADD, fds[0], &event) ==
+		    0);
+		ATF_REQUIRE(epoll_ctl(args.ep, EPOLL_CTL_DEL, fds[0], NULL) ==
+		    0);
+	}
+
+	atomic_store(&args.quit, true);
+	for (int i = 0; i < 4; ++i) {
+		ATF_REQUIRE(pthread_join(threads[i], NULL) == 0);
+	}
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(args.ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(args.ep) == 0);
+}
+
+#ifndef __linux__
+ATF_TC_WITHOUT_HEAD(epoll__consume);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__consume, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	ATF_REQUIRE(tfd >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+
+	struct epoll_event event = {.events = EPOLLIN | EPOLLCONSUME};
+
+	/* Only eventfds and timerfds have a counter to consume. */
+	event.data.fd = fds[0];
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) < 0);
+
+	event.data.fd = efd;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, efd, &event) == 0);
+	event.data.fd = tfd;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &event) == 0);
+
+	ATF_REQUIRE(eventfd_write(efd, 42) == 0);
+
+	struct epoll_event_ex events[2];
+	ATF_REQUIRE(epoll_wait_ex(ep, events, 2, -1) == 1);
+	ATF_REQUIRE(events[0].events == EPOLLIN);
+	ATF_REQUIRE(events[0].data.fd == efd);
+	ATF_REQUIRE(events[0].value == 42);
+
+	/* The counter was consumed. */
+	eventfd_t value;
+	ATF_REQUIRE_ERRNO(EAGAIN, eventfd_read(efd, &value) < 0);
+	ATF_REQUIRE(epoll_wait_ex(ep, events, 2, 0) == 0);
+
+	struct itimerspec time = {
+	    .it_value.tv_nsec = 10000000,
+	    .it_interval.tv_nsec = 10000000,
+	};
+	ATF_REQUIRE(timerfd_settime(tfd, 0, &time, NULL) == 0);
+
+	ATF_REQUIRE(epoll_wait_ex(ep, events, 2, -1) == 1);
+	ATF_REQUIRE(events[0].events == EPOLLIN);
+	ATF_REQUIRE(events[0].data.fd == tfd);
+	ATF_REQUIRE(events[0].value >= 1);
+
+	/* Plain epoll_wait leaves the counter alone. */
+	struct epoll_event ev;
+	ATF_REQUIRE(eventfd_write(efd, 3) == 0);
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, tfd, NULL) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &ev, 1, -1) == 1);
+	ATF_REQUIRE(ev.data.fd == efd);
+	ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+	ATF_REQUIRE(value == 3);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(tfd) == 0);
+	ATF_REQUIRE(close(efd) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__wait_ex_kevent_data);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__wait_ex_kevent_data, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event = {
+	    .events = EPOLLIN | EPOLLOUT,
+	    .data.fd = fds[0],
+	};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	ATF_REQUIRE(write(fds[1], "hello", 5) == 5);
+
+	struct epoll_event_ex events[1];
+	ATF_REQUIRE(epoll_wait_ex(ep, events, 1, -1) == 1);
+	ATF_REQUIRE(events[0].events == (EPOLLIN | EPOLLOUT));
+	ATF_REQUIRE(events[0].data.fd == fds[0]);
+	ATF_REQUIRE(events[0].nreadable == 5);
+	ATF_REQUIRE(events[0].nwritable > 0);
+	ATF_REQUIRE(events[0].error == 0);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__ctl_ex_lowat);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__ctl_ex_lowat, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[3];
+	fd_domain_socket(fds);
+
+	struct epoll_event event = {.events = EPOLLIN, .data.fd = fds[0]};
+
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_ctl_ex(ep, EPOLL_CTL_ADD, fds[0], &event,
+		&(struct epoll_lowat){.rcvlowat = -1}) < 0);
+
+	ATF_REQUIRE(epoll_ctl_ex(ep, EPOLL_CTL_ADD, fds[0], &event,
+			&(struct epoll_lowat){.rcvlowat = 4}) == 0);
+
+	ATF_REQUIRE(write(fds[1], "ab", 2) == 2);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, 100) == 0);
+
+	ATF_REQUIRE(write(fds[1], "cd", 2) == 2);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.events == EPOLLIN);
+
+	/* A plain EPOLL_CTL_MOD removes the low-water mark. */
+	char buf[4];
+	ATF_REQUIRE(read(fds[0], buf, sizeof(buf)) == 4);
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(write(fds[1], "e", 1) == 1);
+	ATF_REQUIRE(epoll_wait(ep, &event, 1, -1) == 1);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__handles);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__handles, tcptr)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	ATF_REQUIRE(tfd >= 0);
+
+	int fds[3];
+	fd_pipe(fds);
+
+	/* Only shimmed fds have handles. */
+	ATF_REQUIRE_ERRNO(EINVAL, epoll_shim_handle_get(fds[0]) == NULL);
+	ATF_REQUIRE_ERRNO(EBADF, epoll_shim_handle_get(-1) == NULL);
+
+	struct epoll_shim_handle *ep_h = epoll_shim_handle_get(ep);
+	ATF_REQUIRE(ep_h != NULL);
+	struct epoll_shim_handle *efd_h = epoll_shim_handle_get(efd);
+	ATF_REQUIRE(efd_h != NULL);
+	struct epoll_shim_handle *tfd_h = epoll_shim_handle_get(tfd);
+	ATF_REQUIRE(tfd_h != NULL);
+
+	/* Handles are typed. */
+	struct epoll_event event = {.events = EPOLLIN};
+	ATF_REQUIRE_ERRNO(EINVAL, epoll_ctl_h(efd_h, /**/
+				      EPOLL_CTL_ADD, tfd, &event) < 0);
+	ATF_REQUIRE_ERRNO(EINVAL, eventfd_write_h(ep_h, 1) < 0);
+
+	event.data.fd = efd;
+	ATF_REQUIRE(epoll_ctl_h(ep_h, EPOLL_CTL_ADD, efd, &event) == 0);
+	event.data.fd = tfd;
+	ATF_REQUIRE(epoll_ctl_h(ep_h, EPOLL_CTL_ADD, tfd, &event) == 0);
+
+	ATF_REQUIRE(eventfd_write_h(efd_h, 1) == 0);
+	ATF_REQUIRE(epoll_wait_h(ep_h, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.data.fd == efd);
+
+	eventfd_t value;
+	ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+	ATF_REQUIRE(value == 1);
+
+	struct itimerspec time = {.it_value.tv_nsec = 1000000};
+	ATF_REQUIRE(timerfd_settime_h(tfd_h, 0, &time, NULL) == 0);
+	ATF_REQUIRE(epoll_wait_h(ep_h, &event, 1, -1) == 1);
+	ATF_REQUIRE(event.data.fd == tfd);
+
+	/* A handle keeps the object alive after close. */
+	ATF_REQUIRE(close(efd) == 0);
+	ATF_REQUIRE(eventfd_write_h(efd_h, 1) == 0);
+
+	epoll_shim_handle_put(efd_h);
+	epoll_shim_handle_put(tfd_h);
+	epoll_shim_handle_put(ep_h);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(tfd) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__evict_closed);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__evict_closed, tcptr)
+{
+	int ep1 = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep1 >= 0);
+	int ep2 = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep2 >= 0);
+
+	int fds[2];
+	ATF_REQUIRE(socketpair(PF_LOCAL, SOCK_STREAM, 0, fds) == 0);
+
+	struct epoll_event event = {.events = EPOLLIN | EPOLLOUT};
+	ATF_REQUIRE(epoll_ctl(ep1, EPOLL_CTL_ADD, fds[0], &event) == 0);
+	ATF_REQUIRE(epoll_ctl(ep2, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	unsigned long count;
+	ATF_REQUIRE(epoll_evictions(ep1, &count) == 0);
+	ATF_REQUIRE(count == 0);
+
+	int closed_fd = fds[0];
+	ATF_REQUIRE(close(fds[0]) == 0);
+
+	ATF_REQUIRE(epoll_evictions(ep1, &count) == 0);
+	ATF_REQUIRE(count == 1);
+	ATF_REQUIRE(epoll_evictions(ep2, &count) == 0);
+	ATF_REQUIRE(count == 1);
+
+	ATF_REQUIRE(epoll_wait(ep1, &event, 1, 0) == 0);
+
+	/* The fd number can be registered again once it is reused. */
+	int fd = dup(fds[1]);
+	ATF_REQUIRE(fd == closed_fd);
+	ATF_REQUIRE(epoll_ctl(ep1, EPOLL_CTL_ADD, fd, &event) == 0);
+	ATF_REQUIRE(close(fd) == 0);
+
+	ATF_REQUIRE(epoll_evictions(ep1, &count) == 0);
+	ATF_REQUIRE(count == 2);
+	ATF_REQUIRE_ERRNO(EINVAL, epoll_evictions(fds[1], &count) < 0);
+
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep2) == 0);
+	ATF_REQUIRE(close(ep1) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__poller_thread);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__poller_thread, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC | EPOLL_POLLER_THREAD);
+	ATF_REQUIRE(ep >= 0);
+
+	int fd = open("/dev/random", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		atf_tc_skip("This test needs /dev/random");
+	}
+
+	struct epoll_event event = {.events = 0};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event) == 0);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	pthread_t thread;
+	ATF_REQUIRE(pthread_create(&thread, NULL, /**/
+			&poll_only_fd_thread_fun, &ep) == 0);
+
+	/* Racy way of making sure that the thread is waiting. */
+	usleep(200000);
+
+	event.events = EPOLLIN;
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fd, &event) == 0);
+	ATF_REQUIRE(pthread_join(thread, NULL) == 0);
+
+	/* Level triggered readiness is reported on every wait. */
+	for (int i = 0; i < 3; ++i) {
+		ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+		ATF_REQUIRE(event_result.events == EPOLLIN);
+	}
+
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fd) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+static void
+poll_only_fd_edge_triggered_impl(int flags)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC | flags);
+	ATF_REQUIRE(ep >= 0);
+
+	int fd = open("/dev/random", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		atf_tc_skip("This test needs /dev/random");
+	}
+
+	struct epoll_event event = {.events = EPOLLIN | EPOLLET};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event) == 0);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+
+	/* The fd stays readable, but that has been reported already. */
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 100) == 0);
+
+	/* Modification rearms the registration. */
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fd, &event) == 0);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(fd) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__poll_only_fd_edge_triggered);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__poll_only_fd_edge_triggered, tc)
+{
+	poll_only_fd_edge_triggered_impl(0);
+	poll_only_fd_edge_triggered_impl(EPOLL_POLLER_THREAD);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__sharded);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__sharded, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC | EPOLL_SHARDED);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[32][3];
+	for (int i = 0; i < 32; ++i) {
+		fd_domain_socket(fds[i]);
+
+		struct epoll_event event = {
+		    .events = EPOLLIN | EPOLLET,
+		    .data.fd = fds[i][0],
+		};
+		ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[i][0], &event) ==
+		    0);
+	}
+
+	struct epoll_event event_results[32];
+	ATF_REQUIRE(epoll_wait(ep, event_results, 32, 0) == 0);
+
+	for (int i = 0; i < 32; ++i) {
+		ATF_REQUIRE(write(fds[i][1], "a", 1) == 1);
+	}
+
+	/* Events of all shards make the epoll fd readable. */
+	struct pollfd pfd = {.fd = ep, .events = POLLIN};
+	ATF_REQUIRE(poll(&pfd, 1, -1) == 1);
+	ATF_REQUIRE(pfd.revents == POLLIN);
+
+	int nr_seen = 0;
+	int n;
+	while ((n = epoll_wait(ep, event_results, 4, 0)) > 0) {
+		for (int i = 0; i < n; ++i) {
+			ATF_REQUIRE(event_results[i].events == EPOLLIN);
+		}
+		nr_seen += n;
+	}
+	ATF_REQUIRE(n == 0);
+	ATF_REQUIRE(nr_seen == 32);
+
+	ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+	pthread_t thread;
+	ATF_REQUIRE(pthread_create(&thread, NULL, /**/
+			&poll_only_fd_thread_fun, &ep) == 0);
+
+	/* Racy way of making sure that the thread is waiting. */
+	usleep(200000);
+
+	ATF_REQUIRE(write(fds[17][1], "b", 1) == 1);
+	ATF_REQUIRE(pthread_join(thread, NULL) == 0);
+
+	for (int i = 0; i < 32; ++i) {
+		ATF_REQUIRE(close(fds[i][0]) == 0);
+		ATF_REQUIRE(close(fds[i][1]) == 0);
+	}
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__single_threaded);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__single_threaded, tc)
+{
+	ATF_REQUIRE_ERRNO(EINVAL,
+	    epoll_create1(EPOLL_SINGLE_THREADED | EPOLL_POLLER_THREAD) < 0);
+
+	int ep = epoll_create1(EPOLL_CLOEXEC | EPOLL_SINGLE_THREADED);
+	ATF_REQUIRE(ep >= 0);
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_CLOEXEC | TFD_SINGLE_THREADED);
+	ATF_REQUIRE(tfd >= 0);
+
+	struct epoll_event event = {.events = EPOLLIN, .data.fd = tfd};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &event) == 0);
+
+	struct itimerspec time = {.it_value.tv_nsec = 100000000};
+	ATF_REQUIRE(timerfd_settime(tfd, 0, &time, NULL) == 0);
+
+	struct epoll_event event_result;
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, -1) == 1);
+	ATF_REQUIRE(event_result.events == EPOLLIN);
+	ATF_REQUIRE(event_result.data.fd == tfd);
+
+	uint64_t exp;
+	ATF_REQUIRE(read(tfd, &exp, sizeof(exp)) == (ssize_t)sizeof(exp));
+	ATF_REQUIRE(exp == 1);
+	ATF_REQUIRE(epoll_wait(ep, &event_result, 1, 0) == 0);
+
+	ATF_REQUIRE(close(tfd) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(epoll__kernel_caps);
+ATF_TC_BODY_FD_LEAKCHECK(epoll__kernel_caps, tc)
+{
+	unsigned int caps = epoll_shim_kernel_caps();
+	fprintf(stderr, "kernel caps: %#x\n", caps);
+
+	/* The kernel is probed once, the result does not change. */
+	ATF_REQUIRE(epoll_shim_kernel_caps() == caps);
+
+	ATF_REQUIRE((caps &
+			(EPOLL_SHIM_CAP_FIFO_EPIPE |
+			    EPOLL_SHIM_CAP_FIFO_EBADF)) !=
+	    (EPOLL_SHIM_CAP_FIFO_EPIPE | EPOLL_SHIM_CAP_FIFO_EBADF));
+}
+#endif
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, epoll__simple);
@@ -1738,6 +2433,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, epoll__modify_existing);
 	ATF_TP_ADD_TC(tp, epoll__modify_nonexisting);
 	ATF_TP_ADD_TC(tp, epoll__poll_only_fd);
+	ATF_TP_ADD_TC(tp, epoll__poll_only_fd_many);
 	ATF_TP_ADD_TC(tp, epoll__no_epollin_on_closed_empty_pipe);
 	ATF_TP_ADD_TC(tp, epoll__write_to_pipe_until_full);
 	ATF_TP_ADD_TC(tp, epoll__realtime_timer);
@@ -1754,10 +2450,26 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, epoll__datagram_connection);
 	ATF_TP_ADD_TC(tp, epoll__epollout_on_own_shutdown);
 	ATF_TP_ADD_TC(tp, epoll__remove_closed);
+	ATF_TP_ADD_TC(tp, epoll__modify_closed);
 	ATF_TP_ADD_TC(tp, epoll__add_different_file_with_same_fd_value);
 	ATF_TP_ADD_TC(tp, epoll__invalid_writes);
 	ATF_TP_ADD_TC(tp, epoll__using_real_close);
 	ATF_TP_ADD_TC(tp, epoll__epoll_pwait);
+	ATF_TP_ADD_TC(tp, epoll__eventfd);
+	ATF_TP_ADD_TC(tp, epoll__oneshot_rearm);
+	ATF_TP_ADD_TC(tp, epoll__ctl_during_wait);
+#ifndef __linux__
+	ATF_TP_ADD_TC(tp, epoll__consume);
+	ATF_TP_ADD_TC(tp, epoll__wait_ex_kevent_data);
+	ATF_TP_ADD_TC(tp, epoll__ctl_ex_lowat);
+	ATF_TP_ADD_TC(tp, epoll__handles);
+	ATF_TP_ADD_TC(tp, epoll__evict_closed);
+	ATF_TP_ADD_TC(tp, epoll__poller_thread);
+	ATF_TP_ADD_TC(tp, epoll__poll_only_fd_edge_triggered);
+	ATF_TP_ADD_TC(tp, epoll__sharded);
+	ATF_TP_ADD_TC(tp, epoll__single_threaded);
+	ATF_TP_ADD_TC(tp, epoll__kernel_caps);
+#endif
 
 	return atf_no_error();
 }
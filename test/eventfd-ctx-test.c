@@ -349,7 +349,116 @@ ATF_TC_BODY_FD_LEAKCHECK(eventfd__threads_read, tc)
 		}
 
 		ATF_REQUIRE(close(efd) == 0);
-		ATF_REQUIRE(read_counter == 2 * counter_val);
+		ATF_REQUIRE(atomic_load(&read_counter) == 2 * (int)counter_val);
+	}
+}
+
+#define STRESS_WRITERS 4
+#define STRESS_READERS 2
+#define STRESS_WRITES 20000
+
+typedef struct {
+	int efd;
+	int signal_pipe[2];
+	atomic_uint_least64_t *sum;
+} StressThreadArgs;
+
+static void *
+stress_write_fun(void *arg)
+{
+	StressThreadArgs *args = arg;
+
+	for (int i = 0; i < STRESS_WRITES; ++i) {
+		ATF_REQUIRE(eventfd_write(args->efd, 1) == 0);
+	}
+
+	return (NULL);
+}
+
+static void *
+stress_read_fun(void *arg)
+{
+	StressThreadArgs *args = arg;
+
+	for (;;) {
+		uint64_t value;
+
+		if (eventfd_read(args->efd, &value) == 0) {
+			atomic_fetch_add(args->sum, value);
+			continue;
+		}
+
+		ATF_REQUIRE(errno == EAGAIN);
+
+		/*
+		 * A lost wakeup would block here forever and make the test
+		 * time out.
+		 */
+		struct pollfd pfds[2] = {/**/
+		    {.fd = args->efd, .events = POLLIN},
+		    {.fd = args->signal_pipe[0], .events = POLLIN}};
+		ATF_REQUIRE(poll(pfds, nitems(pfds), -1) > 0);
+
+		if (pfds[1].revents) {
+			break;
+		}
+	}
+
+	return (NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(eventfd__threads_stress);
+ATF_TC_BODY_FD_LEAKCHECK(eventfd__threads_stress, tc)
+{
+	for (int semaphore = 0; semaphore <= 1; ++semaphore) {
+		atomic_uint_least64_t sum;
+		atomic_init(&sum, 0);
+
+		StressThreadArgs args = {.sum = &sum};
+		ATF_REQUIRE((args.efd = eventfd(0,
+				 EFD_CLOEXEC | EFD_NONBLOCK |
+				     (semaphore ? EFD_SEMAPHORE : 0))) >= 0);
+		ATF_REQUIRE(pipe2(args.signal_pipe, O_CLOEXEC) == 0);
+
+		pthread_t writers[STRESS_WRITERS];
+		pthread_t readers[STRESS_READERS];
+
+		for (int i = 0; i < STRESS_READERS; ++i) {
+			ATF_REQUIRE(pthread_create(&readers[i], NULL,
+					stress_read_fun, &args) == 0);
+		}
+		for (int i = 0; i < STRESS_WRITERS; ++i) {
+			ATF_REQUIRE(pthread_create(&writers[i], NULL,
+					stress_write_fun, &args) == 0);
+		}
+
+		for (int i = 0; i < STRESS_WRITERS; ++i) {
+			ATF_REQUIRE(pthread_join(writers[i], NULL) == 0);
+		}
+
+		while (atomic_load(&sum) != STRESS_WRITERS * STRESS_WRITES) {
+			ATF_REQUIRE(atomic_load(&sum) <
+			    STRESS_WRITERS * STRESS_WRITES);
+			usleep(1000);
+		}
+
+		uint8_t c = 0;
+		ATF_REQUIRE(write(args.signal_pipe[1], &c, 1) == 1);
+
+		for (int i = 0; i < STRESS_READERS; ++i) {
+			ATF_REQUIRE(pthread_join(readers[i], NULL) == 0);
+		}
+
+		uint64_t value;
+		ATF_REQUIRE_ERRNO(EAGAIN, eventfd_read(args.efd, &value) < 0);
+
+		/* No stale readiness must be left behind. */
+		struct pollfd pfd = {.fd = args.efd, .events = POLLIN};
+		ATF_REQUIRE(poll(&pfd, 1, 0) == 0);
+
+		ATF_REQUIRE(close(args.signal_pipe[0]) == 0);
+		ATF_REQUIRE(close(args.signal_pipe[1]) == 0);
+		ATF_REQUIRE(close(args.efd) == 0);
 	}
 }
 
@@ -515,6 +624,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, eventfd__write_read);
 	ATF_TP_ADD_TC(tp, eventfd__write_read_semaphore);
 	ATF_TP_ADD_TC(tp, eventfd__threads_read);
+	ATF_TP_ADD_TC(tp, eventfd__threads_stress);
 	ATF_TP_ADD_TC(tp, eventfd__fork);
 	ATF_TP_ADD_TC(tp, eventfd__stat);
 	/*
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <atf-c.h>
+
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NR_SAMPLES (200)
+#define TIMEOUT_NANOS (250000)
+
+#ifndef TFD_PRECISE
+#define TFD_PRECISE 0
+#endif
+
+static int
+int64_cmp(void const *a, void const *b)
+{
+	int64_t x = *(int64_t const *)a;
+	int64_t y = *(int64_t const *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static int64_t
+timespec_to_nanos(struct timespec const *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*
+ * Arms a 250us one-shot timer NR_SAMPLES times and records how late each
+ * expiration is observed by a blocking read. The median lateness is returned.
+ */
+static int64_t
+measure_jitter(int flags, char const *name)
+{
+	int64_t *lateness = malloc(NR_SAMPLES * sizeof(int64_t));
+	ATF_REQUIRE(lateness);
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | flags);
+	ATF_REQUIRE(tfd >= 0);
+
+	for (int i = 0; i < NR_SAMPLES; ++i) {
+		struct itimerspec time = {
+		    .it_value.tv_nsec = TIMEOUT_NANOS,
+		};
+		struct timespec start, end;
+
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+		ATF_REQUIRE(timerfd_settime(tfd, 0, &time, NULL) == 0);
+
+		uint64_t exp;
+		ATF_REQUIRE(read(tfd, &exp, sizeof(exp)) == (ssize_t)sizeof(exp));
+		ATF_REQUIRE(exp == 1);
+
+		ATF_REQUIRE(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+		lateness[i] = timespec_to_nanos(&end) -
+		    timespec_to_nanos(&start) - TIMEOUT_NANOS;
+
+		/* A timer must never expire early. */
+		ATF_REQUIRE(lateness[i] >= 0);
+	}
+
+	ATF_REQUIRE(close(tfd) == 0);
+
+	qsort(lateness, NR_SAMPLES, sizeof(int64_t), int64_cmp);
+
+	int64_t median = lateness[NR_SAMPLES / 2];
+	fprintf(stderr, "%s: lateness min %lldns median %lldns max %lldns\n",
+	    name, (long long)lateness[0], (long long)median,
+	    (long long)lateness[NR_SAMPLES - 1]);
+
+	free(lateness);
+	return median;
+}
+
+ATF_TC(perf_timerfd_jitter__jitter);
+ATF_TC_HEAD(perf_timerfd_jitter__jitter, tc)
+{
+	atf_tc_set_md_var(tc, "timeout", "30");
+}
+ATF_TC_BODY(perf_timerfd_jitter__jitter, tc)
+{
+	(void)measure_jitter(0, "default");
+
+	int64_t median = measure_jitter(TFD_PRECISE, "precise");
+
+	/*
+	 * Be generous here to not fail on loaded machines. Without the
+	 * precision mode, systems lacking NOTE_USECONDS land at several
+	 * milliseconds.
+	 */
+	ATF_REQUIRE(median < 1000000);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, perf_timerfd_jitter__jitter);
+
+	return atf_no_error();
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <atf-c.h>
+
+#include <sys/types.h>
+
+#include <sys/event.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <dlfcn.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "atf-c-leakcheck.h"
+
+/*
+ * Count the system calls the shim makes on our behalf by interposing the
+ * relevant libc functions. Only built on kqueue platforms.
+ */
+
+static bool count_syscalls;
+static int syscall_count;
+
+#undef read
+#undef write
+
+ssize_t
+read(int fd, void *buf, size_t nbytes)
+{
+	ssize_t (*real_read)(int, void *, size_t) =
+	    (ssize_t(*)(int, void *, size_t))dlsym(RTLD_NEXT, "read");
+
+	if (count_syscalls) {
+		++syscall_count;
+	}
+
+	return real_read(fd, buf, nbytes);
+}
+
+ssize_t
+write(int fd, void const *buf, size_t nbytes)
+{
+	ssize_t (*real_write)(int, void const *, size_t) =
+	    (ssize_t(*)(int, void const *, size_t))dlsym(RTLD_NEXT, "write");
+
+	if (count_syscalls) {
+		++syscall_count;
+	}
+
+	return real_write(fd, buf, nbytes);
+}
+
+int
+poll(struct pollfd fds[], nfds_t nfds, int timeout)
+{
+	int (*real_poll)(struct pollfd[], nfds_t, int) =
+	    (int (*)(struct pollfd[], nfds_t, int))dlsym(RTLD_NEXT, "poll");
+
+	if (count_syscalls) {
+		++syscall_count;
+	}
+
+	return real_poll(fds, nfds, timeout);
+}
+
+int
+fstat(int fd, struct stat *sb)
+{
+	int (*real_fstat)(int, struct stat *) =
+	    (int (*)(int, struct stat *))dlsym(RTLD_NEXT, "fstat");
+
+	if (count_syscalls) {
+		++syscall_count;
+	}
+
+	return real_fstat(fd, sb);
+}
+
+#ifdef __NetBSD__
+#define kevent_n_type size_t
+#else
+#define kevent_n_type int
+#endif
+
+int
+kevent(int kq, const struct kevent *changelist, kevent_n_type nchanges,
+    struct kevent *eventlist, kevent_n_type nevents,
+    const struct timespec *timeout)
+{
+	int (*real_kevent)(int, const struct kevent *, kevent_n_type,
+	    struct kevent *, kevent_n_type, const struct timespec *) =
+	    (int (*)(int, const struct kevent *, kevent_n_type,
+		struct kevent *, kevent_n_type,
+		const struct timespec *))dlsym(RTLD_NEXT, "kevent");
+
+	if (count_syscalls) {
+		++syscall_count;
+	}
+
+	return real_kevent(kq, changelist, nchanges, /**/
+	    eventlist, nevents, timeout);
+}
+
+static void
+start_counting(void)
+{
+	syscall_count = 0;
+	count_syscalls = true;
+}
+
+static int
+stop_counting(void)
+{
+	count_syscalls = false;
+	return syscall_count;
+}
+
+#ifdef EVFILT_USER
+#define EXPECTED_DRAIN_SYSCALLS 1
+#else
+/* Without EVFILT_USER the self-pipe must be drained as well. */
+#define EXPECTED_DRAIN_SYSCALLS 2
+#endif
+
+ATF_TC_WITHOUT_HEAD(syscall_count__eventfd_read);
+ATF_TC_BODY_FD_LEAKCHECK(syscall_count__eventfd_read, tc)
+{
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ATF_REQUIRE(efd >= 0);
+
+	for (int i = 0; i < 10; ++i) {
+		start_counting();
+		ATF_REQUIRE(eventfd_write(efd, 1) == 0);
+		ATF_REQUIRE(stop_counting() <= 1);
+
+		eventfd_t value;
+		start_counting();
+		ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+		int count = stop_counting();
+		ATF_REQUIRE(value == 1);
+		ATF_REQUIRE(count <= EXPECTED_DRAIN_SYSCALLS);
+	}
+
+	ATF_REQUIRE(close(efd) == 0);
+}
+
+ATF_TC_WITHOUT_HEAD(syscall_count__eventfd_read_semaphore);
+ATF_TC_BODY_FD_LEAKCHECK(syscall_count__eventfd_read_semaphore, tc)
+{
+	int efd = eventfd(3, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	ATF_REQUIRE(efd >= 0);
+
+	eventfd_t value;
+
+	/* Reads that leave the counter non-zero need no system call. */
+	for (int i = 0; i < 2; ++i) {
+		start_counting();
+		ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+		ATF_REQUIRE(stop_counting() == 0);
+		ATF_REQUIRE(value == 1);
+	}
+
+	start_counting();
+	ATF_REQUIRE(eventfd_read(efd, &value) == 0);
+	ATF_REQUIRE(stop_counting() <= EXPECTED_DRAIN_SYSCALLS);
+	ATF_REQUIRE(value == 1);
+
+	ATF_REQUIRE_ERRNO(EAGAIN, eventfd_read(efd, &value) < 0);
+
+	ATF_REQUIRE(close(efd) == 0);
+}
+
+/* Removal and re-registration of the knotes, but no fstat. */
+#define EXPECTED_CTL_MOD_SYSCALLS 2
+
+ATF_TC_WITHOUT_HEAD(syscall_count__epoll_ctl_mod);
+ATF_TC_BODY_FD_LEAKCHECK(syscall_count__epoll_ctl_mod, tc)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	ATF_REQUIRE(ep >= 0);
+
+	int fds[2];
+	ATF_REQUIRE(socketpair(PF_LOCAL, SOCK_STREAM, 0, fds) == 0);
+
+	struct epoll_event event = {.events = EPOLLIN};
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &event) == 0);
+
+	event.events = EPOLLIN | EPOLLOUT;
+	start_counting();
+	ATF_REQUIRE(epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &event) == 0);
+	ATF_REQUIRE(stop_counting() <= EXPECTED_CTL_MOD_SYSCALLS);
+
+	ATF_REQUIRE(close(fds[0]) == 0);
+	ATF_REQUIRE(close(fds[1]) == 0);
+	ATF_REQUIRE(close(ep) == 0);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, syscall_count__eventfd_read);
+	ATF_TP_ADD_TC(tp, syscall_count__eventfd_read_semaphore);
+	ATF_TP_ADD_TC(tp, syscall_count__epoll_ctl_mod);
+
+	return atf_no_error();
+}
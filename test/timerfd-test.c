@@ -14,6 +14,7 @@
 
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +22,7 @@
 
 #include <err.h>
 #include <poll.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -687,6 +689,128 @@ ATF_TC_BODY_FD_LEAKCHECK(timerfd__argument_overflow, tc)
 	ATF_REQUIRE(close(timerfd) == 0);
 }
 
+static struct itimerspec const concurrent_gettime_values[2] = {
+    {.it_value = {1, 100000000}, .it_interval = {1, 100000000}},
+    {.it_value = {2, 200000000}, .it_interval = {2, 200000000}},
+};
+
+static atomic_bool concurrent_gettime_done;
+
+static void *
+concurrent_gettime_settime_fun(void *arg)
+{
+	int timerfd = *(int *)arg;
+
+	for (int i = 0; i < 100000; ++i) {
+		ATF_REQUIRE(timerfd_settime(timerfd, 0,
+				&concurrent_gettime_values[i % 2], NULL) == 0);
+	}
+
+	atomic_store(&concurrent_gettime_done, true);
+	return NULL;
+}
+
+ATF_TC_WITHOUT_HEAD(timerfd__concurrent_gettime);
+ATF_TC_BODY_FD_LEAKCHECK(timerfd__concurrent_gettime, tc)
+{
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, /**/
+	    TFD_CLOEXEC | TFD_NONBLOCK);
+	ATF_REQUIRE(timerfd >= 0);
+
+	atomic_store(&concurrent_gettime_done, false);
+
+	pthread_t settime_thread;
+	ATF_REQUIRE(pthread_create(&settime_thread, NULL,
+			concurrent_gettime_settime_fun, &timerfd) == 0);
+
+	while (!atomic_load(&concurrent_gettime_done)) {
+		struct itimerspec curr_value;
+		ATF_REQUIRE(timerfd_gettime(timerfd, &curr_value) == 0);
+
+		if (curr_value.it_interval.tv_sec == 0 &&
+		    curr_value.it_interval.tv_nsec == 0) {
+			/* Not armed yet. */
+			ATF_REQUIRE(curr_value.it_value.tv_sec == 0);
+			ATF_REQUIRE(curr_value.it_value.tv_nsec == 0);
+			continue;
+		}
+
+		/* The interval must never be a mix of both settings. */
+		struct itimerspec const *expected =
+		    &concurrent_gettime_values[ /**/
+			curr_value.it_interval.tv_sec == 1 ? 0 : 1];
+		ATF_REQUIRE(curr_value.it_interval.tv_sec ==
+		    expected->it_interval.tv_sec);
+		ATF_REQUIRE(curr_value.it_interval.tv_nsec ==
+		    expected->it_interval.tv_nsec);
+
+		ATF_REQUIRE(curr_value.it_value.tv_sec <=
+		    expected->it_value.tv_sec);
+	}
+
+	ATF_REQUIRE(pthread_join(settime_thread, NULL) == 0);
+
+	ATF_REQUIRE(close(timerfd) == 0);
+}
+
+#ifndef __linux__
+ATF_TC_WITHOUT_HEAD(timerfd__settime_many);
+ATF_TC_BODY_FD_LEAKCHECK(timerfd__settime_many, tc)
+{
+	int timerfds[100];
+
+	for (int i = 0; i < (int)nitems(timerfds); ++i) {
+		timerfds[i] = timerfd_create(CLOCK_MONOTONIC, /**/
+		    TFD_CLOEXEC | TFD_NONBLOCK);
+		ATF_REQUIRE(timerfds[i] >= 0);
+	}
+
+	struct timerfd_settime_entry entries[nitems(timerfds) + 2];
+	for (int i = 0; i < (int)nitems(timerfds); ++i) {
+		entries[i] = (struct timerfd_settime_entry){
+		    .fd = timerfds[i],
+		    .v.it_value.tv_nsec = 100000000,
+		};
+	}
+	entries[nitems(timerfds)] = (struct timerfd_settime_entry){
+	    .fd = -1,
+	    .v.it_value.tv_nsec = 100000000,
+	};
+	entries[nitems(timerfds) + 1] = (struct timerfd_settime_entry){
+	    .fd = timerfds[0],
+	    .flags = 42,
+	    .v.it_value.tv_nsec = 100000000,
+	};
+
+	int errs[nitems(entries)];
+	ATF_REQUIRE_ERRNO(EBADF,
+	    timerfd_settime_many(entries, nitems(entries), errs) < 0);
+
+	for (int i = 0; i < (int)nitems(timerfds); ++i) {
+		ATF_REQUIRE(errs[i] == 0);
+	}
+	ATF_REQUIRE(errs[nitems(timerfds)] == EBADF);
+	ATF_REQUIRE(errs[nitems(timerfds) + 1] == EINVAL);
+
+	for (int i = 0; i < (int)nitems(timerfds); ++i) {
+		struct pollfd pfd = {.fd = timerfds[i], .events = POLLIN};
+		ATF_REQUIRE(poll(&pfd, 1, -1) == 1);
+
+		uint64_t timeouts;
+		ATF_REQUIRE(read(timerfds[i], &timeouts, sizeof(timeouts)) ==
+		    (ssize_t)sizeof(timeouts));
+		ATF_REQUIRE(timeouts == 1);
+	}
+
+	ATF_REQUIRE(timerfd_settime_many(entries, nitems(timerfds), NULL) ==
+	    0);
+
+	for (int i = 0; i < (int)nitems(timerfds); ++i) {
+		ATF_REQUIRE(close(timerfds[i]) == 0);
+	}
+}
+#endif
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, timerfd__many_timers);
@@ -703,6 +827,10 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, timerfd__absolute_timer);
 	ATF_TP_ADD_TC(tp, timerfd__periodic_timer_performance);
 	ATF_TP_ADD_TC(tp, timerfd__argument_overflow);
+	ATF_TP_ADD_TC(tp, timerfd__concurrent_gettime);
+#ifndef __linux__
+	ATF_TP_ADD_TC(tp, timerfd__settime_many);
+#endif
 
 	return atf_no_error();
 }